@@ -0,0 +1,35 @@
+#!/bin/sh
+# end-to-end benchmark: mount convmvfs over a generated tree on tmpfs and
+# compare it with the raw tree. Extra arguments are passed to convmvfs,
+# e.g. "-o ocharset=GBK". Kernel caching of names and attributes is turned
+# off so that every request reaches convmvfs.
+
+set -e
+
+bindir=${BENCH_BINDIR:-$(dirname "$0")}
+top=$(mktemp -d "${BENCH_TMPDIR:-/dev/shm}/convmvfs-bench.XXXXXX")
+src=$top/src
+mnt=$top/mnt
+mkdir "$src" "$mnt"
+
+cleanup(){
+  fusermount -u "$mnt" 2>/dev/null || true
+  rm -rf "$top"
+}
+trap cleanup EXIT
+
+"$bindir/convmvfs-bench" mktree "$src"
+"$bindir/convmvfs" "$mnt" -f -o srcdir="$src" \
+  -o entry_timeout=0,negative_timeout=0,attr_timeout=0 "$@" 2>/dev/null &
+
+i=0
+until [ "$(stat -c %d "$mnt")" != "$(stat -c %d "$top")" ]; do
+  i=$((i + 1))
+  if [ $i -gt 50 ]; then
+    echo "convmvfs did not mount $mnt" >&2
+    exit 1
+  fi
+  sleep 0.1
+done
+
+"$bindir/convmvfs-bench" e2e "$src" "$mnt"
@@ -0,0 +1,352 @@
+/* (C) 2006-2010 ZC Miao <hellwolf.misty@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ */
+
+/*
+ * benchmarks for convmvfs
+ *
+ *   convmvfs-bench                 micro benchmarks of name conversion and
+ *                                  permission walks
+ *   convmvfs-bench mktree DIR      generate a test tree in DIR
+ *   convmvfs-bench e2e RAW MNT     compare stat/readdir/open/read on the raw
+ *                                  tree RAW and on a convmvfs mount MNT of it
+ *
+ * Results are printed on stdout as JSON Lines: one object per result, with
+ * "bench" set to "micro" or "e2e".
+ */
+
+#include "config.h"
+
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+
+#include "conv.h"
+#include "perm.h"
+
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+using namespace std;
+
+static const int BENCH_MIN_NSEC = 200000000; /* run each micro bench 0.2s */
+static const int TREE_DIRS = 64;
+static const int TREE_FILES = 64;
+static const size_t READ_SIZE = 4096;
+static const int E2E_ROUNDS = 4;
+
+static double now_ns(){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/*
+ * micro benchmarks
+ */
+static string long_name(const string &unit, size_t len){
+  string s = "/";
+  while(s.size() + unit.size() <= len)
+    s += unit;
+  return s;
+}
+
+static void bench_conv(const char *name, struct convmvfs_conv *conv,
+                       const string &s, int direction){
+  struct convmvfs_convdir *dir = direction ? &conv->in2out : &conv->out2in;
+  volatile size_t sink = 0;
+  long n = 0;
+  double begin = now_ns(), end;
+  do{
+    for(int i = 0; i < 1000; ++i){
+      string r = convert(conv, dir, s.c_str());
+      sink += r.size();
+    }
+    n += 1000;
+    end = now_ns();
+  }while(end - begin < BENCH_MIN_NSEC);
+  (void)sink;
+
+  printf("{\"bench\": \"micro\", \"name\": \"%s\", \"len\": %zu, "
+         "\"ops\": %ld, \"ns_per_op\": %.1f}\n",
+         name, s.size(), n, (end - begin) / n);
+}
+
+static void bench_permission_walk(const char *top, int depth){
+  string path = top;
+  for(int i = 0; i < depth; ++i){
+    char d[32];
+    snprintf(d, sizeof(d), "/d%d", i);
+    path += d;
+    mkdir(path.c_str(), 0755);
+  }
+  string file = path + "/f";
+  close(open(file.c_str(), O_CREAT|O_WRONLY, 0644));
+
+  long n = 0;
+  double begin = now_ns(), end;
+  do{
+    for(int i = 0; i < 100; ++i)
+      permission_walk(file.c_str(), 65534, 65534, PERM_WALK_CHECK_READ);
+    n += 100;
+    end = now_ns();
+  }while(end - begin < BENCH_MIN_NSEC);
+
+  printf("{\"bench\": \"micro\", \"name\": \"permission_walk\", "
+         "\"depth\": %d, \"ops\": %ld, \"ns_per_op\": %.1f}\n",
+         depth, n, (end - begin) / n);
+}
+
+static void rm_tree(const string &path){
+  DIR *dir = opendir(path.c_str());
+  if(dir){
+    struct dirent *pdirent;
+    while((pdirent = readdir(dir)) != NULL){
+      if(!strcmp(pdirent->d_name, ".") || !strcmp(pdirent->d_name, ".."))
+        continue;
+      rm_tree(path + "/" + pdirent->d_name);
+    }
+    closedir(dir);
+    rmdir(path.c_str());
+  }else{
+    unlink(path.c_str());
+  }
+}
+
+static int micro(){
+  static const char *ascii = "/pub/linux/kernel/v2.6/linux-2.6.32.tar.bz2";
+  static const char *cjk =
+    "/\xe4\xb8\xad\xe6\x96\x87/\xe6\x96\x87\xe4\xbb\xb6\xe5\xa4\xb9/"
+    "\xe6\xb5\x8b\xe8\xaf\x95\xe6\x96\x87\xe6\xa1\xa3.txt";
+  static const char *invalid = "/bad\xff\xfe\xe4\xb8/name\xc0\xaf.txt";
+
+  struct convmvfs_conv convs[2];
+  struct convmvfs_conv *utf8 = &convs[0];
+  struct convmvfs_conv *gbk = &convs[1];
+  conv_init(*utf8, "UTF-8", "UTF-8", 0, 0);
+  conv_init(*gbk, "UTF-8", "GBK", 0, 0);
+  string cjk_gbk = convert(gbk, &gbk->in2out, cjk);
+
+  bench_conv("in2out_utf8_ascii", utf8, ascii, 1);
+  bench_conv("in2out_gbk_ascii", gbk, ascii, 1);
+  bench_conv("in2out_gbk_cjk", gbk, cjk, 1);
+  bench_conv("out2in_gbk_cjk", gbk, cjk_gbk, 0);
+  bench_conv("in2out_gbk_long", gbk, long_name("\xe4\xb8\xad", 255), 1);
+  bench_conv("in2out_gbk_invalid", gbk, invalid, 1);
+  bench_conv("out2in_gbk_escaped", gbk, convert(gbk, &gbk->in2out, invalid), 0);
+
+  normalize_form = NORMALIZE_NFC;
+  bench_conv("in2out_utf8_ascii_nfc", utf8, ascii, 1);
+  bench_conv("in2out_utf8_cjk_nfc", utf8, cjk, 1);
+  normalize_form = NORMALIZE_NONE;
+  conv_close(*utf8);
+  conv_close(*gbk);
+
+  char top[] = "/tmp/convmvfs-bench.XXXXXX";
+  if(mkdtemp(top) == NULL){
+    perror("mkdtemp");
+    return 1;
+  }
+  chmod(top, 0755);
+  int depths[] = {1, 4, 16, 64};
+  for(size_t i = 0; i < sizeof(depths) / sizeof(depths[0]); ++i){
+    string dir = string(top) + "/" + (char)('a' + i);
+    mkdir(dir.c_str(), 0755);
+    bench_permission_walk(dir.c_str(), depths[i]);
+  }
+  rm_tree(top);
+  return 0;
+}
+
+/*
+ * test tree: TREE_DIRS directories of TREE_FILES small files, named in
+ * ASCII, CJK and with a byte that is not valid UTF-8
+ */
+static int mktree(const char *top){
+  static const char *names[] = {
+    "file", "\xe6\x96\x87\xe4\xbb\xb6", "Datei-\xc3\xa4", "bad\xff",
+  };
+  const size_t nnames = sizeof(names) / sizeof(names[0]);
+  char data[READ_SIZE];
+  memset(data, 'x', sizeof(data));
+
+  for(int d = 0; d < TREE_DIRS; ++d){
+    char n[16];
+    snprintf(n, sizeof(n), "%d", d);
+    string dir = string(top) + "/" + names[d % nnames] + n;
+    if(mkdir(dir.c_str(), 0755) && errno != EEXIST){
+      perror(dir.c_str());
+      return 1;
+    }
+    for(int f = 0; f < TREE_FILES; ++f){
+      snprintf(n, sizeof(n), "%d", f);
+      string file = dir + "/" + names[f % nnames] + n + ".txt";
+      int fd = open(file.c_str(), O_CREAT|O_WRONLY|O_TRUNC, 0644);
+      if(fd == -1){
+        perror(file.c_str());
+        return 1;
+      }
+      if(write(fd, data, sizeof(data)) != (ssize_t)sizeof(data))
+        perror(file.c_str());
+      close(fd);
+    }
+  }
+  return 0;
+}
+
+/*
+ * end-to-end
+ */
+static void walk(const string &path, vector<string> &dirs,
+                 vector<string> &files){
+  dirs.push_back(path);
+  DIR *dir = opendir(path.c_str());
+  if(dir == NULL)
+    return;
+  struct dirent *pdirent;
+  while((pdirent = readdir(dir)) != NULL){
+    if(!strcmp(pdirent->d_name, ".") || !strcmp(pdirent->d_name, ".."))
+      continue;
+    string p = path + "/" + pdirent->d_name;
+    struct stat stbuf;
+    if(lstat(p.c_str(), &stbuf))
+      continue;
+    if(S_ISDIR(stbuf.st_mode))
+      walk(p, dirs, files);
+    else
+      files.push_back(p);
+  }
+  closedir(dir);
+}
+
+/*
+ * Each op sets ns to the time of the part it measures; setup and cleanup,
+ * such as the open before a read and the close after it, are left out.
+ */
+static int op_stat(const string &path, double &ns){
+  struct stat stbuf;
+  double t = now_ns();
+  int st = lstat(path.c_str(), &stbuf);
+  ns = now_ns() - t;
+  return st;
+}
+
+static int op_readdir(const string &path, double &ns){
+  double t = now_ns();
+  DIR *dir = opendir(path.c_str());
+  if(dir == NULL)
+    return -1;
+  while(readdir(dir) != NULL)
+    ;
+  closedir(dir);
+  ns = now_ns() - t;
+  return 0;
+}
+
+static int op_open(const string &path, double &ns){
+  double t = now_ns();
+  int fd = open(path.c_str(), O_RDONLY);
+  ns = now_ns() - t;
+  if(fd == -1)
+    return -1;
+  close(fd);
+  return 0;
+}
+
+static int op_read(const string &path, double &ns){
+  char buf[READ_SIZE];
+  int fd = open(path.c_str(), O_RDONLY);
+  if(fd == -1)
+    return -1;
+  double t = now_ns();
+  ssize_t n = read(fd, buf, sizeof(buf));
+  ns = now_ns() - t;
+  close(fd);
+  return n < 0 ? -1 : 0;
+}
+
+static void report_e2e(const char *tree, const char *root, const char *op,
+                       const char *rounds, vector<double> &lat, long errors,
+                       double total){
+  sort(lat.begin(), lat.end());
+  printf("{\"bench\": \"e2e\", \"tree\": \"%s\", \"root\": \"%s\", "
+         "\"op\": \"%s\", \"rounds\": \"%s\", \"ops\": %zu, "
+         "\"errors\": %ld, \"ops_per_sec\": %.0f, \"p50_us\": %.2f, "
+         "\"p99_us\": %.2f}\n",
+         tree, root, op, rounds, lat.size(), errors,
+         lat.size() / (total / 1e9),
+         lat.empty() ? 0 : lat[lat.size() / 2] / 1e3,
+         lat.empty() ? 0 : lat[lat.size() * 99 / 100] / 1e3);
+}
+
+/*
+ * each path is visited E2E_ROUNDS times; the first round is reported apart
+ * from the others, which may be served from caches
+ */
+static void bench_e2e(const char *tree, const char *root, const char *op,
+                      const vector<string> &paths,
+                      int (*fn)(const string &, double &)){
+  vector<double> lat[2];
+  long errors[2] = {0, 0};
+  double total[2] = {0, 0};
+  for(int round = 0; round < E2E_ROUNDS; ++round){
+    int r = round > 0;
+    for(size_t i = 0; i < paths.size(); ++i){
+      double ns = 0;
+      if(fn(paths[i], ns))
+        ++errors[r];
+      lat[r].push_back(ns);
+      total[r] += ns;
+    }
+  }
+  report_e2e(tree, root, op, "first", lat[0], errors[0], total[0]);
+  report_e2e(tree, root, op, "rest", lat[1], errors[1], total[1]);
+}
+
+static int e2e(const char *raw, const char *mnt){
+  const char *trees[] = {"raw", "convmvfs"};
+  const char *roots[] = {raw, mnt};
+
+  for(int t = 0; t < 2; ++t){
+    vector<string> dirs, files;
+    walk(roots[t], dirs, files);
+    if(files.empty()){
+      fprintf(stderr, "%s: no files\n", roots[t]);
+      return 1;
+    }
+    bench_e2e(trees[t], roots[t], "stat", files, op_stat);
+    bench_e2e(trees[t], roots[t], "readdir", dirs, op_readdir);
+    bench_e2e(trees[t], roots[t], "open", files, op_open);
+    bench_e2e(trees[t], roots[t], "read", files, op_read);
+  }
+  return 0;
+}
+
+int main(int argc, char *argv[])
+{
+  if(argc == 1)
+    return micro();
+  if(argc == 3 && !strcmp(argv[1], "mktree"))
+    return mktree(argv[2]);
+  if(argc == 4 && !strcmp(argv[1], "e2e"))
+    return e2e(argv[2], argv[3]);
+
+  fprintf(stderr,
+          "usage: %s\n"
+          "       %s mktree DIR\n"
+          "       %s e2e RAWDIR MOUNTPOINT\n",
+          argv[0], argv[0], argv[0]);
+  return 1;
+}
@@ -0,0 +1,284 @@
+/* (C) 2006-2010 ZC Miao <hellwolf.misty@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <strings.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#if HAVE_ICU
+#include <unicode/ustring.h>
+#include <unicode/unorm2.h>
+#endif
+
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+
+#include "conv.h"
+
+using namespace std;
+
+#define OUTINBUFLEN 255
+
+int normalize_form = NORMALIZE_NONE;
+
+static void append_escape(string &res, unsigned char c){
+  static const char hex[] = "0123456789ABCDEF";
+  res += ESCAPE_CHAR;
+  res += hex[c >> 4];
+  res += hex[c & 0xf];
+}
+
+/*
+ * convert len bytes at s, appending to res. Invalid input bytes >= 0x80 are
+ * escaped when encoding; other invalid bytes, and any when decoding, are
+ * passed through untouched.
+ * Must be called with the converter mutex held.
+ */
+static void iconv_run(const iconv_t ic, const char *s, size_t len,
+                      string &res, int encode){
+  char buf[OUTINBUFLEN];
+  char* inbuf((char*)s);
+  size_t ibleft(len);
+
+  while(ibleft){
+    char * outbuf(buf);
+    size_t obleft(OUTINBUFLEN);
+    size_t niconv = iconv(ic,
+                          &inbuf,&ibleft,
+                          &outbuf,&obleft);
+    res.append(buf, OUTINBUFLEN - obleft);
+    if ( niconv != (size_t) -1 )
+      break;
+    switch(errno){
+    case E2BIG:
+      continue;
+    case EINVAL:
+    case EILSEQ:
+    default:
+      if(encode && (unsigned char)*inbuf >= 0x80)
+        append_escape(res, *inbuf);
+      else
+        res += *inbuf;
+      ++inbuf;
+      --ibleft;
+      iconv(ic, NULL, NULL, NULL, NULL);
+      break;
+    }
+  }
+  /* flush shift state */
+  char * outbuf(buf);
+  size_t obleft(OUTINBUFLEN);
+  if(iconv(ic, NULL, NULL, &outbuf, &obleft) != (size_t) -1)
+    res.append(buf, OUTINBUFLEN - obleft);
+}
+
+string outinconv(const char* s, const iconv_t ic, int encode){
+  string res;
+  const char *seg = s;
+  const char *p = s;
+
+  iconv(ic, NULL, NULL, NULL, NULL);
+  while(*p){
+    if(encode ? !needs_escape(p) : !is_decodable_escape(p)){
+      ++p;
+      continue;
+    }
+    iconv_run(ic, seg, p - seg, res, encode);
+    if(encode){
+      append_escape(res, ESCAPE_CHAR);
+      p += 1;
+    }else{
+      res += (char)escape_value(p);
+      p += 3;
+    }
+    seg = p;
+  }
+  iconv_run(ic, seg, p - seg, res, encode);
+  return res;
+}
+
+/*
+ * Unicode normalization
+ */
+int is_utf8(const string &charset){
+  return !strcasecmp(charset.c_str(), "UTF-8") ||
+    !strcasecmp(charset.c_str(), "UTF8");
+}
+
+/*
+ * Quick check: code points below U+0300 never change under NFC, and ASCII
+ * never changes under NFD, so a name without any byte >= limit is already
+ * normalized. This is the common case and is checked 16 bytes at a time.
+ */
+int normalized_quick(const char *s, size_t len, int form){
+  const unsigned char limit = form == NORMALIZE_NFC ? 0xcc : 0x80;
+  const unsigned char *p = (const unsigned char *)s;
+  const unsigned char *end = p + len;
+#ifdef __SSE2__
+  const __m128i vlimit = _mm_set1_epi8((char)limit);
+  for(; end - p >= 16; p += 16){
+    __m128i v = _mm_loadu_si128((const __m128i *)p);
+    /* max(v, limit) == v iff v >= limit */
+    if(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_max_epu8(v, vlimit), v)))
+      return 0;
+  }
+#endif
+  for(; p < end; ++p)
+    if(*p >= limit)
+      return 0;
+  return 1;
+}
+
+/* s in the given form, or s itself if it is not valid UTF-8 */
+string normalize_utf8(const string &s, int form){
+  if(form == NORMALIZE_NONE || normalized_quick(s.data(), s.size(), form))
+    return s;
+#if HAVE_ICU
+  UErrorCode err = U_ZERO_ERROR;
+  const UNormalizer2 *norm = form == NORMALIZE_NFC ?
+    unorm2_getNFCInstance(&err) : unorm2_getNFDInstance(&err);
+  if(U_FAILURE(err))
+    return s;
+
+  int32_t ulen;
+  u_strFromUTF8(NULL, 0, &ulen, s.data(), s.size(), &err);
+  if(err != U_BUFFER_OVERFLOW_ERROR)
+    return s;
+  err = U_ZERO_ERROR;
+  vector<UChar> u(ulen + 1);
+  u_strFromUTF8(&u[0], u.size(), NULL, s.data(), s.size(), &err);
+  if(U_FAILURE(err))
+    return s;
+  if(unorm2_isNormalized(norm, &u[0], ulen, &err) || U_FAILURE(err))
+    return s;
+
+  int32_t nlen = unorm2_normalize(norm, &u[0], ulen, NULL, 0, &err);
+  if(err != U_BUFFER_OVERFLOW_ERROR)
+    return s;
+  err = U_ZERO_ERROR;
+  vector<UChar> n(nlen + 1);
+  unorm2_normalize(norm, &u[0], ulen, &n[0], n.size(), &err);
+  if(U_FAILURE(err))
+    return s;
+
+  /* and a UTF-16 unit takes at most 3 bytes of UTF-8 */
+  vector<char> buf(nlen * 3 + 1);
+  int32_t blen;
+  u_strToUTF8(&buf[0], buf.size(), &blen, &n[0], nlen, &err);
+  if(U_FAILURE(err))
+    return s;
+  return string(&buf[0], blen);
+#else
+  return s;
+#endif
+}
+
+/*
+ * name cache
+ */
+static size_t name_hash(const char *s){
+  /* FNV-1a */
+  uint32_t h = 2166136261u;
+  while(*s){
+    h ^= (unsigned char)*s++;
+    h *= 16777619u;
+  }
+  return h;
+}
+
+/*
+ * convert s in one direction: cached, then charset conversion with the
+ * UTF-8 side normalized
+ */
+string convert(struct convmvfs_conv *conv,
+                      struct convmvfs_convdir *dir, const char *s){
+  pair<string, string> *slot = NULL;
+  if(!dir->cache.empty()){
+    slot = &dir->cache[name_hash(s) % dir->cache.size()];
+    pthread_mutex_lock(&conv->mutex);
+    if(slot->first == s){
+      string res = slot->second;
+      pthread_mutex_unlock(&conv->mutex);
+      return res;
+    }
+    pthread_mutex_unlock(&conv->mutex);
+  }
+
+  string res;
+  if(normalize_form != NORMALIZE_NONE && dir->from_utf8 && !dir->to_utf8){
+    string in = normalize_utf8(s, normalize_form);
+    pthread_mutex_lock(&conv->mutex);
+    res = outinconv(in.c_str(), dir->ic, dir->encode);
+    pthread_mutex_unlock(&conv->mutex);
+  }else{
+    pthread_mutex_lock(&conv->mutex);
+    res = outinconv(s, dir->ic, dir->encode);
+    pthread_mutex_unlock(&conv->mutex);
+    if(normalize_form != NORMALIZE_NONE && dir->to_utf8)
+      res = normalize_utf8(res, normalize_form);
+  }
+
+  if(slot){
+    pthread_mutex_lock(&conv->mutex);
+    slot->first = s;
+    slot->second = res;
+    pthread_mutex_unlock(&conv->mutex);
+  }
+  return res;
+}
+
+void conv_init(struct convmvfs_conv &conv, const string &icharset,
+               const string &ocharset, int namecache, int fold){
+  conv.out2in.ic = iconv_open(icharset.c_str(),ocharset.c_str());
+  if( conv.out2in.ic == (iconv_t)(-1) ){
+    perror("iconv out2in");
+    exit(1);
+  }
+  conv.out2in.from_utf8 = is_utf8(ocharset);
+  conv.out2in.to_utf8 = is_utf8(icharset);
+  conv.out2in.encode = 0;
+  conv.in2out.ic = iconv_open(ocharset.c_str(),icharset.c_str());
+  if( conv.in2out.ic == (iconv_t)(-1) ){
+    perror("iconv in2out");
+    exit(1);
+  }
+  conv.in2out.from_utf8 = is_utf8(icharset);
+  conv.in2out.to_utf8 = is_utf8(ocharset);
+  conv.in2out.encode = 1;
+  conv.in2utf8.ic = (iconv_t)(-1);
+  if(fold && !is_utf8(icharset)){
+    conv.in2utf8.ic = iconv_open("UTF-8", icharset.c_str());
+    if( conv.in2utf8.ic == (iconv_t)(-1) ){
+      perror("iconv in2utf8");
+      exit(1);
+    }
+    conv.in2utf8.from_utf8 = 0;
+    conv.in2utf8.to_utf8 = 1;
+    conv.in2utf8.encode = 1;
+  }
+  if(namecache > 0){
+    conv.out2in.cache.resize(namecache);
+    conv.in2out.cache.resize(namecache);
+  }
+  pthread_mutex_init(&conv.mutex, NULL);
+}
+
+void conv_close(struct convmvfs_conv &conv){
+  iconv_close(conv.out2in.ic);
+  iconv_close(conv.in2out.ic);
+  if(conv.in2utf8.ic != (iconv_t)(-1))
+    iconv_close(conv.in2utf8.ic);
+  pthread_mutex_destroy(&conv.mutex);
+}
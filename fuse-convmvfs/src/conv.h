@@ -0,0 +1,114 @@
+/* (C) 2006-2010 ZC Miao <hellwolf.misty@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ */
+
+/*
+ * Conversion of names between the source charset and the mounted one,
+ * used by convmvfs and convmvfs-bench.
+ *
+ * Bytes >= 0x80 that iconv can not convert are escaped as %XX, so every
+ * source name maps to its own mounted name and can be mapped back without
+ * looking at the directory.  Only these escapes and %25 are ever decoded:
+ * a '%' that would otherwise read as one of them is escaped as %25, and any
+ * other %XX, such as %20 or %2F, is an ordinary part of the name. So is a
+ * '%' followed by '~', which convmvfs uses to mark names cut short.
+ */
+
+#ifndef CONVMVFS_CONV_H
+#define CONVMVFS_CONV_H
+
+#include <iconv.h>
+#include <pthread.h>
+#include <string>
+#include <vector>
+#include <utility>
+
+#define ESCAPE_CHAR '%'
+
+enum {
+  NORMALIZE_NONE,
+  NORMALIZE_NFC,
+  NORMALIZE_NFD,
+};
+
+/* form of the names on the UTF-8 side of each converter */
+extern int normalize_form;
+
+inline int hexval(char c){
+  if(c >= '0' && c <= '9')
+    return c - '0';
+  if(c >= 'A' && c <= 'F')
+    return c - 'A' + 10;
+  if(c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  return -1;
+}
+
+/* byte value of the escape at s, or -1 if s does not start an escape */
+inline int escape_value(const char *s){
+  if(s[0] != ESCAPE_CHAR)
+    return -1;
+  int h = hexval(s[1]);
+  if(h < 0)
+    return -1;
+  int l = hexval(s[2]);
+  if(l < 0)
+    return -1;
+  return h << 4 | l;
+}
+
+inline bool is_decodable_escape(const char *s){
+  int v = escape_value(s);
+  return v == ESCAPE_CHAR || v >= 0x80;
+}
+
+/* whether a '%' at s has to be escaped when encoding */
+inline bool needs_escape(const char *s){
+  return is_decodable_escape(s) || (s[0] == ESCAPE_CHAR && s[1] == '~');
+}
+
+/*
+ * One direction of a converter: the iconv handle, whether each side is
+ * UTF-8 (where normalization applies), and a direct-mapped cache of
+ * converted names.
+ */
+struct convmvfs_convdir {
+  iconv_t ic;
+  int from_utf8;
+  int to_utf8;
+  int encode;
+  std::vector<std::pair<std::string, std::string> > cache;
+};
+
+/*
+ * One pair of converters per (icharset, ocharset), shared by every view
+ * using that pair. With fold and a non UTF-8 icharset, in2utf8 turns source
+ * names into UTF-8 to be case-folded; otherwise its handle is (iconv_t)(-1).
+ */
+struct convmvfs_conv {
+  struct convmvfs_convdir out2in;
+  struct convmvfs_convdir in2out;
+  struct convmvfs_convdir in2utf8;
+  pthread_mutex_t mutex;
+};
+
+/* exits if a charset is not supported */
+void conv_init(struct convmvfs_conv &conv, const std::string &icharset,
+               const std::string &ocharset, int namecache, int fold);
+void conv_close(struct convmvfs_conv &conv);
+
+/* must be called with the converter mutex held */
+std::string outinconv(const char *s, const iconv_t ic, int encode);
+
+int is_utf8(const std::string &charset);
+int normalized_quick(const char *s, size_t len, int form);
+std::string normalize_utf8(const std::string &s, int form);
+
+std::string convert(struct convmvfs_conv *conv,
+                    struct convmvfs_convdir *dir, const char *s);
+
+#endif /* CONVMVFS_CONV_H */
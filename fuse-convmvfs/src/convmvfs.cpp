@@ -21,17 +21,34 @@
 #include <errno.h>
 #include <iconv.h>
 #include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+
+#if HAVE_ICU
+#include <unicode/ustring.h>
+#include <unicode/uchar.h>
+#endif
 
 #if HAVE_ATTR_XATTR_H
 #include <attr/xattr.h>
 #endif
 
+#include "conv.h"
+#include "perm.h"
+#include "record.h"
+
 #include <cstdlib>
 #include <cstdio>
 #include <cstring>
 #include <cstddef>
 #include <cassert>
 #include <string>
+#include <map>
+#include <utility>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <unordered_map>
 
 
 using namespace std;
@@ -43,17 +60,49 @@ using namespace std;
 static const char* CONVMVFS_DEFAULT_SRCDIR = "/"; /* root dir */
 static const char* CONVMVFS_DEFAULT_ICHARSET = "UTF-8";
 static const char* CONVMVFS_DEFAULT_OCHARSET = "UTF-8";
+static const int CONVMVFS_DEFAULT_NAMECACHE = 1024;
+static const size_t CASE_INDEX_MAX_DIRS = 64;
+static const size_t SCHED_BULK_UNIT = 65536;
+static const int SCHED_META_BURST = 3;
+static const int CONVMVFS_DEFAULT_MAX_QUEUED = 16;
 
 struct convmvfs {
   const char *cwd;
   const char *srcdir;
   const char *icharset;
   const char *ocharset;
+  const char *viewfile;
+  const char *normalize;
+  int namecache;
+  int ignorecase;
+  int max_inflight;
+  int max_queued;
+  const char *record;
 };
 static struct convmvfs convmvfs;
 
+typedef map<pair<string, string>, struct convmvfs_conv> conv_map;
+static conv_map convs;
+
+/*
+ * A view mirrors one srcdir in one charset. With a single view it is the
+ * whole mount; with several, each one is a subdirectory of the mount root.
+ */
+struct convmvfs_view {
+  string name;
+  string srcdir;
+  string icharset;
+  string ocharset;
+  struct convmvfs_conv *conv;
+};
+typedef map<string, struct convmvfs_view> view_map;
+static view_map views;
+static vector<string> view_specs;
+static int multiview;
+
 static uid_t euid;
 gid_t egid;
+static time_t start_time;
 
 static void init_gvars(){
   static char cwd[MAXPATHLEN];
@@ -62,22 +111,28 @@ static void init_gvars(){
   convmvfs.srcdir = CONVMVFS_DEFAULT_SRCDIR;
   convmvfs.icharset = CONVMVFS_DEFAULT_ICHARSET;
   convmvfs.ocharset =  CONVMVFS_DEFAULT_OCHARSET;
+  convmvfs.viewfile = NULL;
+  convmvfs.normalize = NULL;
+  convmvfs.namecache = CONVMVFS_DEFAULT_NAMECACHE;
+  convmvfs.ignorecase = 0;
+  convmvfs.max_inflight = 0;
+  convmvfs.max_queued = CONVMVFS_DEFAULT_MAX_QUEUED;
+  convmvfs.record = NULL;
 
   euid = geteuid();
   egid = getegid();
+  start_time = time(NULL);
 }
 
 static struct fuse_operations convmvfs_oper;
 
-static iconv_t ic_out2in,ic_in2out;
-static pthread_mutex_t iconv_mutex = PTHREAD_MUTEX_INITIALIZER;
-
 /*
  * options and usage
  */
 enum {
   KEY_HELP,
   KEY_VERSION,
+  KEY_VIEW,
 };
 
 #define CONVMVFS_OPT(t, p, v) { t, offsetof(struct convmvfs, p), v }
@@ -86,6 +141,15 @@ static struct fuse_opt convmvfs_opts[] = {
   CONVMVFS_OPT("srcdir=%s", srcdir, 0),
   CONVMVFS_OPT("icharset=%s", icharset, 0),
   CONVMVFS_OPT("ocharset=%s", ocharset, 0),
+  CONVMVFS_OPT("viewfile=%s", viewfile, 0),
+  CONVMVFS_OPT("normalize=%s", normalize, 0),
+  CONVMVFS_OPT("namecache=%d", namecache, 0),
+  CONVMVFS_OPT("ignorecase", ignorecase, 1),
+  CONVMVFS_OPT("max_inflight=%d", max_inflight, 0),
+  CONVMVFS_OPT("max_queued=%d", max_queued, 0),
+  CONVMVFS_OPT("record=%s", record, 0),
+
+  FUSE_OPT_KEY("view=",     KEY_VIEW),
 
   FUSE_OPT_KEY("-V",        KEY_VERSION),
   FUSE_OPT_KEY("--version", KEY_VERSION),
@@ -100,19 +164,33 @@ static void usage(){
          "    -o srcdir=PATH         which directory to convert\n"
          "    -o icharset=CHARSET    charset used in srcdir\n"
          "    -o ocharset=CHARSET    charset used in mounted filesystem\n"
+         "    -o view=NAME:PATH[:ICHARSET[:OCHARSET]]\n"
+         "                           mount PATH as subdirectory NAME, may be repeated\n"
+         "    -o viewfile=FILE       read views from FILE, one\n"
+         "                           \"NAME PATH [ICHARSET [OCHARSET]]\" per line\n"
+         "    -o normalize=nfc|nfd   Unicode normalization of UTF-8 names\n"
+         "    -o namecache=N         converted names cached per converter (1024)\n"
+         "    -o ignorecase          case-insensitive lookup of names\n"
+         "    -o max_inflight=N      limit concurrent requests, shared fairly\n"
+         "                           between users (0, unlimited)\n"
+         "    -o max_queued=N        waiting requests per user, more fail\n"
+         "                           with EAGAIN (16)\n"
+         "    -o record=FILE         record requests to FILE for convmvfs-replay\n"
          );
 }
 
 static int convmvfs_opt_proc(void *data, const char *arg,int key,
                           struct fuse_args *outargs)
 {
-  (void)arg;
   (void)data;
   
   switch (key) {
   case FUSE_OPT_KEY_OPT:
   case FUSE_OPT_KEY_NONOPT:
     return 1;
+  case KEY_VIEW:
+    view_specs.push_back(arg + strlen("view="));
+    return 0;
   case KEY_VERSION:
     fprintf(stderr, PACKAGE"\t"VERSION"\n"
             "Copyright (C) 2006 ZC Miao <hellwolf@seu.edu.cn>\n\n"
@@ -131,156 +209,745 @@ static int convmvfs_opt_proc(void *data, const char *arg,int key,
   }
 }
 
+/*
+ * util funs
+ */
+inline
+static string out2in(const struct convmvfs_view *view, const char* s){
+  return convert(view->conv, &view->conv->out2in, s);
+}
 
+inline
+static string in2out(const struct convmvfs_view *view, const char* s){
+  return convert(view->conv, &view->conv->in2out, s);
+}
 
 /*
- * util funs
+ * long names
+ *
+ * A name whose mounted form would exceed LONG_NAME_MAX bytes is shown cut
+ * short and ended by LONG_NAME_MARK and 16 hex digits of a hash of the
+ * source name; such names are mapped back by reading the directory. A '%'
+ * followed by '~' is escaped as %25 too, so no other name ends that way.
  */
-#define OUTINBUFLEN 255
-static string outinconv(const char* s, const iconv_t ic){
-  char buf[OUTINBUFLEN];
-  char* inbuf((char*)s);
-  char * outbuf(buf);
-  size_t ibleft(strlen(inbuf)),obleft(OUTINBUFLEN);
-  string res;
+#define LONG_NAME_MARK "%~"
+#define LONG_NAME_TAIL 18       /* the mark and the hash */
+static const size_t LONG_NAME_MAX = 255;
+
+static uint64_t long_name_hash(const char *s){
+  /* 64 bit FNV-1a */
+  uint64_t h = 14695981039346656037ull;
+  while(*s){
+    h ^= (unsigned char)*s++;
+    h *= 1099511628211ull;
+  }
+  return h;
+}
 
-  do{
-    pthread_mutex_lock(&iconv_mutex);
-    size_t niconv = iconv(ic,
-                   &inbuf,&ibleft,
-                   &outbuf,&obleft);
-    pthread_mutex_unlock(&iconv_mutex);
-    if ( niconv == (size_t) -1 ){
-      switch(errno){
-      case EINVAL:
-      case EILSEQ:
-        return res + string(buf, OUTINBUFLEN - obleft) + "???";
-        break;
-      case E2BIG:
-        res += string(buf,OUTINBUFLEN - obleft);
-        outbuf = buf;
-        obleft = OUTINBUFLEN;
-        continue;
-      default:
-        return "????";
-      }
+/* in2out() of the source name name, cut short if too long */
+static string in2out_name(const struct convmvfs_view *view, const char *name){
+  string res = in2out(view, name);
+  if(res.size() <= LONG_NAME_MAX)
+    return res;
+
+  /* the longest source prefix whose conversion leaves room for the tail */
+  struct convmvfs_conv *conv = view->conv;
+  size_t room = LONG_NAME_MAX - LONG_NAME_TAIL;
+  size_t len = strlen(name) * room / res.size();
+  string prefix;
+  pthread_mutex_lock(&conv->mutex);
+  for(;; --len){
+    prefix = outinconv(string(name, len).c_str(), conv->in2out.ic, 1);
+    if(prefix.size() <= room)
+      break;
+  }
+  pthread_mutex_unlock(&conv->mutex);
+
+  char tail[LONG_NAME_TAIL + 1];
+  snprintf(tail, sizeof(tail), "%s%016llX", LONG_NAME_MARK,
+           (unsigned long long)long_name_hash(name));
+  return prefix + tail;
+}
+
+/* hash in a name made by in2out_name(), or 0 if it is not cut short */
+static int long_name_parse(const string &oname, uint64_t &hash){
+  if(oname.size() < LONG_NAME_TAIL ||
+     oname.compare(oname.size() - LONG_NAME_TAIL, 2, LONG_NAME_MARK))
+    return 0;
+  hash = 0;
+  for(size_t i = oname.size() - LONG_NAME_TAIL + 2; i < oname.size(); ++i){
+    int v = hexval(oname[i]);
+    if(v < 0 || (oname[i] >= 'a' && oname[i] <= 'f'))
+      return 0;
+    hash = hash << 4 | v;
+  }
+  return 1;
+}
+
+/* entry of source directory dir shown as the cut short name oname */
+static int long_name_lookup(const struct convmvfs_view *view,
+                            const string &dir, const string &oname,
+                            uint64_t hash, string &real){
+  DIR *d = opendir(dir.empty() ? "/" : dir.c_str());
+  if(d == NULL)
+    return -errno;
+  int rt = -ENOENT;
+  struct dirent *pdirent;
+  while((pdirent = readdir(d)) != NULL)
+    if(long_name_hash(pdirent->d_name) == hash &&
+       in2out_name(view, pdirent->d_name) == oname){
+      real = pdirent->d_name;
+      rt = 0;
+      break;
     }
-    res += string(buf,OUTINBUFLEN - obleft);
-    break;
-  }while(1);
-  return res;
+  closedir(d);
+  return rt;
 }
 
-inline
-static string out2in(const char* s){
-  return outinconv(s,ic_out2in);
+/*
+ * out2in() of a name given to the mount, which must be the very name
+ * in2out() shows for its result: an escape of bytes that would convert,
+ * such as %C3%A9 for a UTF-8 source, or a needless %25, would otherwise
+ * reach the same source name as the converted form
+ */
+static int out2in_strict(const struct convmvfs_view *view, const char *s,
+                         string &res){
+  res = out2in(view, s);
+  const char *p = s;
+  while((p = strchr(p, ESCAPE_CHAR)) != NULL && !needs_escape(p))
+    ++p;
+  if(p == NULL)
+    return 0;
+  string shown = s;
+  if(normalize_form != NORMALIZE_NONE && view->conv->in2out.to_utf8)
+    shown = normalize_utf8(shown, normalize_form);
+  return in2out(view, res.c_str()) == shown ? 0 : -EINVAL;
 }
 
-inline
-static string in2out(const char* s){
-  return outinconv(s,ic_in2out);
+/* out2in_strict() of path opath, which may have cut short names */
+static int out2in_path(const struct convmvfs_view *view, const char *opath,
+                       string &res){
+  if(strstr(opath, LONG_NAME_MARK) == NULL)
+    return out2in_strict(view, opath, res);
+
+  res.clear();
+  const char *b = opath;
+  while(*b){
+    const char *e = strchr(b + 1, '/');
+    if(e == NULL)
+      e = b + strlen(b);
+    string oname(b + 1, e - b - 1), name;
+    uint64_t hash;
+    int st;
+    if(long_name_parse(oname, hash))
+      st = long_name_lookup(view, view->srcdir + res, oname, hash, name);
+    else
+      st = out2in_strict(view, oname.c_str(), name);
+    if(st)
+      return st;
+    res += '/' + name;
+    b = e;
+  }
+  return 0;
+}
+
+/*
+ * case-insensitive lookup
+ *
+ * A name that does not exist is looked up again, component by component, in
+ * a per-directory index from case-folded source name to source name. Names
+ * are folded in UTF-8, so that bytes of a multibyte source charset are never
+ * folded on their own. The index is built on first use and rebuilt when the
+ * directory mtime changes, except for changes made through the mount, which
+ * are applied to it directly. An index built in the second of the last
+ * change may miss another change in that second, and is rebuilt on its
+ * first use after that second.
+ */
+struct case_index {
+  time_t mtime;
+  int racy;
+  unsigned long used;
+  unordered_multimap<string, string> names;
+};
+/* keys depend on the converter, so views of one directory share no index */
+typedef pair<const struct convmvfs_conv *, string> case_index_id;
+typedef map<case_index_id, struct case_index> case_index_map;
+static case_index_map case_indexes;
+static unsigned long case_index_clock;
+static pthread_mutex_t case_index_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static string fold_case(const string &s){
+  string res = s;
+#if HAVE_ICU
+  if(!normalized_quick(s.data(), s.size(), NORMALIZE_NFD)){
+    UErrorCode err = U_ZERO_ERROR;
+    int32_t ulen;
+    u_strFromUTF8(NULL, 0, &ulen, s.data(), s.size(), &err);
+    if(err == U_BUFFER_OVERFLOW_ERROR){
+      err = U_ZERO_ERROR;
+      /* full case folding expands a UTF-16 unit into at most 3 */
+      vector<UChar> u(ulen + 1), f(ulen * 3 + 1);
+      u_strFromUTF8(&u[0], u.size(), NULL, s.data(), s.size(), &err);
+      int32_t flen = u_strFoldCase(&f[0], f.size(), &u[0], ulen,
+                                   U_FOLD_CASE_DEFAULT, &err);
+      vector<char> buf(flen * 3 + 1);
+      int32_t blen;
+      u_strToUTF8(&buf[0], buf.size(), &blen, &f[0], flen, &err);
+      if(U_SUCCESS(err))
+        return string(&buf[0], blen);
+    }
+  }
+#endif
+  /* bytes of UTF-8 multibyte sequences are all above 0x7f */
+  for(size_t i = 0; i < res.size(); ++i)
+    if(res[i] >= 'A' && res[i] <= 'Z')
+      res[i] += 'a' - 'A';
+  return res;
 }
 
+/* index key of source name name */
+static string case_key(const struct convmvfs_view *view, const string &name){
+  struct convmvfs_conv *conv = view->conv;
+  if(conv->in2utf8.ic == (iconv_t)(-1))
+    return fold_case(name);
+  pthread_mutex_lock(&conv->mutex);
+  string utf8 = outinconv(name.c_str(), conv->in2utf8.ic, 1);
+  pthread_mutex_unlock(&conv->mutex);
+  return fold_case(utf8);
+}
 
-#define PERM_WALK_CHECK_READ   01
-#define PERM_WALK_CHECK_WRITE  02
-#define PERM_WALK_CHECK_EXEC   04
-static int permission_walk(const char *path, uid_t uid, gid_t gid,
-                           int perm_chk, int readlink = 0){
-  int rt;
-  //I'm root~~
-  if(uid == 0){
-    return 0;
+/*
+ * real name of the entry of source directory dir that folds to the same
+ * name as the given one
+ */
+static int case_lookup(const struct convmvfs_view *view, const string &dir,
+                       const string &name, string &real){
+  struct stat stbuf;
+  if(stat(dir.empty() ? "/" : dir.c_str(), &stbuf))
+    return -errno;
+  string key = case_key(view, name);
+  case_index_id id(view->conv, dir);
+
+  pthread_mutex_lock(&case_index_mutex);
+  case_index_map::iterator it = case_indexes.find(id);
+  if(it != case_indexes.end() && it->second.mtime == stbuf.st_mtime &&
+     !(it->second.racy && time(NULL) > stbuf.st_mtime)){
+    it->second.used = ++case_index_clock;
+    unordered_multimap<string, string>::const_iterator n =
+      it->second.names.find(key);
+    int rt = -ENOENT;
+    if(n != it->second.names.end()){
+      real = n->second;
+      rt = 0;
+    }
+    pthread_mutex_unlock(&case_index_mutex);
+    return rt;
   }
-  size_t l = strlen(path) + 1;
-  char *p = (char*)malloc(l);
-  if(p == NULL){
-    return -ENOMEM;
+  pthread_mutex_unlock(&case_index_mutex);
+
+  struct case_index index;
+  index.mtime = stbuf.st_mtime;
+  index.racy = time(NULL) <= stbuf.st_mtime;
+  DIR *d = opendir(dir.empty() ? "/" : dir.c_str());
+  if(d == NULL)
+    return -errno;
+  struct dirent *pdirent;
+  while((pdirent = readdir(d)) != NULL)
+    index.names.insert(make_pair(case_key(view, pdirent->d_name),
+                                 string(pdirent->d_name)));
+  closedir(d);
+
+  int rt = -ENOENT;
+  unordered_multimap<string, string>::const_iterator n =
+    index.names.find(key);
+  if(n != index.names.end()){
+    real = n->second;
+    rt = 0;
   }
-  strncpy(p, path, l);
 
-  char *s = p;
-  if(*s == '\0'){
-    //Empty pathname, see PATH_RESOLUTION(2)
-    rt = -ENOENT;
-    goto __free_quit;
+  pthread_mutex_lock(&case_index_mutex);
+  if(case_indexes.size() >= CASE_INDEX_MAX_DIRS && !case_indexes.count(id)){
+    case_index_map::iterator lru = case_indexes.begin();
+    for(it = case_indexes.begin(); it != case_indexes.end(); ++it)
+      if(it->second.used < lru->second.used)
+        lru = it;
+    case_indexes.erase(lru);
   }
-  while(*s++){
+  struct case_index &slot = case_indexes[id];
+  slot.mtime = index.mtime;
+  slot.racy = index.racy;
+  slot.used = ++case_index_clock;
+  slot.names.swap(index.names);
+  pthread_mutex_unlock(&case_index_mutex);
+  return rt;
+}
+
+/*
+ * taken before a handler adds or removes the source entry ipath: afterwards
+ * commit() applies the change to the index of its directory, provided the
+ * index was current before, so that a directory being filled through the
+ * mount is not read again after each new entry
+ */
+class case_index_change {
+public:
+  case_index_change(const struct convmvfs_view *view, const string &ipath)
+    : view(view), current(0){
+    if(!convmvfs.ignorecase)
+      return;
+    size_t p = ipath.rfind('/');
+    dir = ipath.substr(0, p);
+    name = ipath.substr(p + 1);
+    id = case_index_id(view->conv, dir);
+    pthread_mutex_lock(&case_index_mutex);
+    int indexed = case_indexes.count(id);
+    pthread_mutex_unlock(&case_index_mutex);
     struct stat stbuf;
-    int chk;
-    if(*s == '\0'){
-      //final entry
-      if(readlink?lstat(p, &stbuf):stat(p, &stbuf)){
-        rt = -errno;
-        goto __free_quit;
-      }
-      chk = perm_chk;
-    }else if(*s == '/'){
-      //non-final component
-      *s = '\0';
-      if(stat(p, &stbuf)){
-        rt =  -errno;
-        goto __free_quit;
-      }
-      if(!(stbuf.st_mode & S_IFDIR)){
-        rt = -ENOTDIR;
-        goto __free_quit;
-      }
-      *s = '/';
-      chk = PERM_WALK_CHECK_EXEC;
-    }else{
-      continue;
-    }
-    int mr,mw,mx;
-    if(stbuf.st_uid == uid){
-      mr = S_IRUSR;
-      mw = S_IWUSR;
-      mx = S_IXUSR;
-    }else if(stbuf.st_gid == gid){
-      mr = S_IRGRP;
-      mw = S_IWGRP;
-      mx = S_IXGRP;
-    }else{
-      mr = S_IROTH;
-      mw = S_IWOTH;
-      mx = S_IXOTH;
+    if(!indexed || stat(dir.empty() ? "/" : dir.c_str(), &stbuf))
+      return;
+    pthread_mutex_lock(&case_index_mutex);
+    case_index_map::iterator it = case_indexes.find(id);
+    /* the same test as in case_lookup() */
+    current = it != case_indexes.end() && it->second.mtime == stbuf.st_mtime &&
+      !(it->second.racy && time(NULL) > stbuf.st_mtime);
+    pthread_mutex_unlock(&case_index_mutex);
+  }
+
+  void commit(int add){
+    struct stat stbuf;
+    if(!current || stat(dir.empty() ? "/" : dir.c_str(), &stbuf))
+      return;
+    string key = case_key(view, name);
+    pthread_mutex_lock(&case_index_mutex);
+    case_index_map::iterator it = case_indexes.find(id);
+    /* adding or removing is idempotent, whatever ran in between */
+    if(it != case_indexes.end()){
+      struct case_index &index = it->second;
+      pair<unordered_multimap<string, string>::iterator,
+           unordered_multimap<string, string>::iterator> r =
+        index.names.equal_range(key);
+      unordered_multimap<string, string>::iterator n = r.first;
+      while(n != r.second && n->second != name)
+        ++n;
+      if(add && n == r.second)
+        index.names.insert(make_pair(key, name));
+      else if(!add && n != r.second)
+        index.names.erase(n);
+      index.mtime = stbuf.st_mtime;
+      /* a change from outside in the same second would not show */
+      index.racy = time(NULL) <= stbuf.st_mtime;
     }
-    if(chk & PERM_WALK_CHECK_READ){
-      if(!(stbuf.st_mode & mr)){
-        rt = -EACCES;
-        goto __free_quit;
+    pthread_mutex_unlock(&case_index_mutex);
+  }
+
+private:
+  const struct convmvfs_view *view;
+  string dir, name;
+  case_index_id id;
+  int current;
+};
+
+/*
+ * lookup fallbacks
+ *
+ * With normalize= or ignorecase, a request that fails with ENOENT is run
+ * once more with resolve_fallback set. resolve() then replaces each missing
+ * component of the source path by an existing name in the other
+ * normalization form, or by one that folds to the same name. Requests for
+ * names that exist never pay for this.
+ */
+static __thread int resolve_fallback;
+
+static void resolve_missing(const struct convmvfs_view *view, string &ipath){
+  int other = normalize_form == NORMALIZE_NFC ? NORMALIZE_NFD : NORMALIZE_NFC;
+  int normalize = normalize_form != NORMALIZE_NONE &&
+    view->conv->out2in.to_utf8;
+  if(!convmvfs.ignorecase &&
+     (!normalize || normalized_quick(ipath.data(), ipath.size(), other)))
+    return;
+
+  struct stat stbuf;
+  if(!lstat(ipath.c_str(), &stbuf) || errno != ENOENT)
+    return;
+
+  const string &srcdir = view->srcdir;
+  string res = srcdir;
+  size_t b = srcdir.size();
+  int found = 1;
+  while(b < ipath.size()){
+    size_t e = ipath.find('/', b + 1);
+    if(e == string::npos)
+      e = ipath.size();
+    string name = ipath.substr(b + 1, e - b - 1);
+    if(found && !name.empty() &&
+       lstat((res + '/' + name).c_str(), &stbuf)){
+      string real;
+      if(errno != ENOENT){
+        found = 0;
+      }else if(normalize &&
+               (real = normalize_utf8(name, other)) != name &&
+               !lstat((res + '/' + real).c_str(), &stbuf)){
+        name = real;
+      }else if(convmvfs.ignorecase &&
+               !case_lookup(view, res, name, real)){
+        name = real;
+      }else{
+        found = 0;
       }
     }
-    if(chk & PERM_WALK_CHECK_WRITE){
-      if(!(stbuf.st_mode & mw)){
-        rt = -EACCES;
-        goto __free_quit;
-      }
+    res += '/' + name;
+    b = e;
+  }
+  ipath = res;
+}
+
+static int fallback_wanted(const char *opath){
+  if(convmvfs.ignorecase)
+    return 1;
+  /* normalization only changes non-ASCII names */
+  return normalize_form != NORMALIZE_NONE &&
+    !normalized_quick(opath, strlen(opath), NORMALIZE_NFD);
+}
+
+/* runs handler f again with fallbacks when it fails with ENOENT */
+template<typename F, F f> struct with_fallback;
+
+template<typename... A, int (*f)(const char *, A...)>
+struct with_fallback<int (*)(const char *, A...), f> {
+  static int call(const char *opath, A... a){
+    int rt = f(opath, a...);
+    if(rt == -ENOENT && fallback_wanted(opath)){
+      resolve_fallback = 1;
+      rt = f(opath, a...);
+      resolve_fallback = 0;
     }
-    if(chk & PERM_WALK_CHECK_EXEC){
-      if(!(stbuf.st_mode & mx)){
-        rt = -EACCES;
-        goto __free_quit;
-      }
+    return rt;
+  }
+};
+
+/* symlink, rename and link: either path may need the fallback */
+template<int (*f)(const char *, const char *)>
+struct with_fallback<int (*)(const char *, const char *), f> {
+  static int call(const char *path1, const char *path2){
+    int rt = f(path1, path2);
+    if(rt == -ENOENT && (fallback_wanted(path1) || fallback_wanted(path2))){
+      resolve_fallback = 1;
+      rt = f(path1, path2);
+      resolve_fallback = 0;
     }
+    return rt;
   }
+};
 
-  rt = 0;
-__free_quit:
-  free(p);
-  return rt;
+#define WITH_FALLBACK(f) (with_fallback<decltype(&f), &f>::call)
+
+/*
+ * the mount root lists the views when there are several of them
+ */
+inline
+static int is_vroot(const char *opath){
+  return multiview && opath[0] == '/' && opath[1] == '\0';
 }
 
-static int permission_walk_parent(const char *path, uid_t uid, gid_t gid,
-                                  int perm_chk){
-  int l = strlen(path);
-  while(--l)
-    if(path[l] == '/')
-      break;
-  return permission_walk(string(path, l).c_str(), uid, gid,
-                         perm_chk);
+/*
+ * the mount root or a view root, which stand for the view list and srcdir
+ * and must not be removed or renamed
+ */
+static int is_view_root(const char *opath){
+  if(!multiview)
+    return opath[0] == '/' && opath[1] == '\0';
+  const char *rest = strchr(opath + 1, '/');
+  return rest == NULL || rest[1] == '\0';
 }
 
+/*
+ * map a mounted path to its source path, and optionally its view
+ */
+static int resolve(const char *opath, string &ipath,
+                   const struct convmvfs_view **pview = NULL){
+  const struct convmvfs_view *view;
+  if(!multiview){
+    view = &views.begin()->second;
+  }else{
+    if(is_vroot(opath))
+      return -EACCES;
+    const char *name = opath + 1;
+    const char *rest = strchr(name, '/');
+    if(rest == NULL)
+      rest = name + strlen(name);
+    view_map::const_iterator it = views.find(string(name, rest - name));
+    if(it == views.end())
+      return -ENOENT;
+    view = &it->second;
+    opath = *rest ? rest : "/";
+  }
+  string rest;
+  int st = out2in_path(view, opath, rest);
+  if(st)
+    return st;
+  ipath = view->srcdir + rest;
+  if(resolve_fallback)
+    resolve_missing(view, ipath);
+  if(pview)
+    *pview = view;
+  return 0;
+}
+
+
+
+
+/*
+ * request scheduling
+ *
+ * With max_inflight set, at most that many requests run at once. The others
+ * wait in one queue per class, and each queue is served by start-time fair
+ * queuing across the requesting uids: a request is tagged with
+ * max(virtual time, finish tag of its uid's previous request), and costs 1
+ * for metadata or 1 per SCHED_BULK_UNIT bytes for bulk data. Metadata goes
+ * first, but after SCHED_META_BURST metadata requests in a row a waiting
+ * bulk request gets the slot.
+ *
+ * A waiting request holds a FUSE worker thread, so each uid may have at most
+ * max_queued of them; beyond that requests fail with EAGAIN.
+ */
+enum {
+  SCHED_META,
+  SCHED_BULK,
+  SCHED_CLASSES,
+};
+
+struct sched_waiter {
+  pthread_cond_t cond;
+  int granted;
+};
+typedef multimap<pair<double, unsigned long>, struct sched_waiter *> sched_queue;
+
+static sched_queue sched_queues[SCHED_CLASSES];
+static map<uid_t, double> sched_finish[SCHED_CLASSES];
+static double sched_vtime[SCHED_CLASSES];
+static map<uid_t, int> sched_queued;
+static unsigned long sched_seq;
+static int sched_inflight;
+static int sched_meta_run;
+static pthread_mutex_t sched_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static double sched_tag(int cls, uid_t uid, double cost){
+  map<uid_t, double> &finish = sched_finish[cls];
+  if(finish.size() > 1024){
+    /* uids that are not ahead of virtual time need no state */
+    for(map<uid_t, double>::iterator it = finish.begin(); it != finish.end();)
+      if(it->second <= sched_vtime[cls])
+        finish.erase(it++);
+      else
+        ++it;
+  }
+  double start = sched_vtime[cls];
+  map<uid_t, double>::iterator it = finish.find(uid);
+  if(it != finish.end() && it->second > start)
+    start = it->second;
+  finish[uid] = start + cost;
+  return start;
+}
+
+/* returns -EAGAIN if the uid has too many requests waiting */
+static int sched_enter(int cls, size_t size){
+  double cost = cls == SCHED_META ? 1 : 1 + size / SCHED_BULK_UNIT;
+  uid_t uid = fuse_get_context()->uid;
+
+  pthread_mutex_lock(&sched_mutex);
+  if(sched_inflight < convmvfs.max_inflight &&
+     sched_queues[SCHED_META].empty() && sched_queues[SCHED_BULK].empty()){
+    ++sched_inflight;
+    sched_vtime[cls] = sched_tag(cls, uid, cost);
+    pthread_mutex_unlock(&sched_mutex);
+    return 0;
+  }
+  int &queued = sched_queued[uid];
+  if(queued >= convmvfs.max_queued){
+    if(!queued)
+      sched_queued.erase(uid);
+    pthread_mutex_unlock(&sched_mutex);
+    return -EAGAIN;
+  }
+  ++queued;
+  struct sched_waiter w;
+  pthread_cond_init(&w.cond, NULL);
+  w.granted = 0;
+  double tag = sched_tag(cls, uid, cost);
+  sched_queues[cls].insert(make_pair(make_pair(tag, sched_seq++), &w));
+  while(!w.granted)
+    pthread_cond_wait(&w.cond, &sched_mutex);
+  if(!--sched_queued[uid])
+    sched_queued.erase(uid);
+  pthread_mutex_unlock(&sched_mutex);
+  pthread_cond_destroy(&w.cond);
+  return 0;
+}
+
+static void sched_leave(){
+  pthread_mutex_lock(&sched_mutex);
+  int cls = SCHED_META;
+  if(sched_queues[SCHED_META].empty() ||
+     (!sched_queues[SCHED_BULK].empty() && sched_meta_run >= SCHED_META_BURST))
+    cls = SCHED_BULK;
+  if(sched_queues[cls].empty()){
+    --sched_inflight;
+  }else{
+    sched_meta_run = cls == SCHED_META ? sched_meta_run + 1 : 0;
+    /* hand the slot over to the request with the smallest tag */
+    sched_queue::iterator it = sched_queues[cls].begin();
+    sched_vtime[cls] = it->first.first;
+    it->second->granted = 1;
+    pthread_cond_signal(&it->second->cond);
+    sched_queues[cls].erase(it);
+  }
+  pthread_mutex_unlock(&sched_mutex);
+}
+
+/*
+ * request recording, see record.h
+ *
+ * Requests are appended to record_buf, which a writer thread started at
+ * init writes out when it is full and at least once a second. Open files
+ * are numbered in the order of their opens; record_handles maps each open
+ * fi->fh to its number.
+ */
+#define RECORD_BUFLEN 65536
+static FILE *record_file;
+static string record_buf;
+static uint64_t record_start_us, record_prev_us;
+static map<uint64_t, uint64_t> record_handles;
+static uint64_t record_handle_seq;
+static __thread uint64_t record_open_fh;
+static pthread_mutex_t record_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t record_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t record_thread;
+static int record_running, record_stop;
+
+static uint64_t record_now_us(){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void record_write(const string &buf){
+  if(record_file == NULL || buf.empty())
+    return;
+  fwrite(buf.data(), 1, buf.size(), record_file);
+  fflush(record_file);
+}
+
+static void *record_writer(void *data){
+  (void)data;
+  string buf;
+  pthread_mutex_lock(&record_mutex);
+  for(;;){
+    if(!record_stop && record_buf.size() < RECORD_BUFLEN){
+      struct timespec ts;
+      clock_gettime(CLOCK_REALTIME, &ts);
+      ts.tv_sec += 1;
+      pthread_cond_timedwait(&record_cond, &record_mutex, &ts);
+    }
+    buf.swap(record_buf);
+    int stop = record_stop;
+    pthread_mutex_unlock(&record_mutex);
+    record_write(buf);
+    buf.clear();
+    if(stop)
+      return NULL;
+    pthread_mutex_lock(&record_mutex);
+  }
+}
+
+static void record_start(){
+  if(pthread_create(&record_thread, NULL, record_writer, NULL))
+    perror("record writer");
+  else
+    record_running = 1;
+}
+
+/* write out what is left and stop the writer */
+static void record_finish(){
+  if(record_running){
+    pthread_mutex_lock(&record_mutex);
+    record_stop = 1;
+    pthread_cond_signal(&record_cond);
+    pthread_mutex_unlock(&record_mutex);
+    pthread_join(record_thread, NULL);
+  }
+  record_write(record_buf);
+  record_buf.clear();
+}
+
+static void record_oper(int op, const char *path, const char *path2,
+                        uint64_t size, uint64_t offset,
+                        const struct fuse_file_info *fi){
+  struct record r;
+  r.op = op;
+  r.uid = fuse_get_context()->uid;
+  r.size = size;
+  r.offset = offset;
+  r.fh = 0;
+  /* the path of an open file may be gone with hard_remove */
+  if(path)
+    r.path = path;
+  if(path2)
+    r.path2 = path2;
+
+  pthread_mutex_lock(&record_mutex);
+  if(op == RECORD_OP_OPEN){
+    r.fh = record_open_fh = ++record_handle_seq;
+  }else if(fi){
+    map<uint64_t, uint64_t>::iterator it = record_handles.find(fi->fh);
+    if(it != record_handles.end()){
+      r.fh = it->second;
+      if(op == RECORD_OP_RELEASE)
+        record_handles.erase(it);
+    }
+  }
+  r.time_us = record_now_us() - record_start_us;
+  record_encode(record_buf, r, record_prev_us);
+  record_prev_us = r.time_us;
+  if(record_buf.size() >= RECORD_BUFLEN)
+    pthread_cond_signal(&record_cond);
+  pthread_mutex_unlock(&record_mutex);
+}
+
+/* number the file just opened by this thread as its recorded open */
+static void record_bind(const struct fuse_file_info *fi){
+  pthread_mutex_lock(&record_mutex);
+  record_handles[fi->fh] = record_open_fh;
+  pthread_mutex_unlock(&record_mutex);
+}
+
+/*
+ * taken at the start of each handler: records the request and holds a
+ * request slot until the handler returns. The handler returns -EAGAIN at
+ * once if busy() says no slot could be waited for.
+ */
+class oper_guard {
+public:
+  oper_guard(int op, const char *path, const char *path2 = NULL,
+             uint64_t size = 0, uint64_t offset = 0,
+             const struct fuse_file_info *fi = NULL)
+    : active(convmvfs.max_inflight > 0){
+    /* a fallback retry is the same request */
+    if(record_file && !resolve_fallback)
+      record_oper(op, path, path2, size, offset, fi);
+    if(active && sched_enter(op == RECORD_OP_READ || op == RECORD_OP_WRITE ||
+                             op == RECORD_OP_READDIR ? SCHED_BULK : SCHED_META,
+                             size))
+      active = 0;
+  }
+  ~oper_guard(){
+    if(active)
+      sched_leave();
+  }
+  int busy() const{
+    return convmvfs.max_inflight > 0 && !active;
+  }
+private:
+  int active;
+};
 
 /*
  * opers
@@ -290,15 +957,23 @@ static void *convmvfs_init(void){
     perror("fuse init,chdir failed");
     exit(errno);
   }
+  /* after fuse_main has gone to the background */
+  if(record_file)
+    record_start();
   return NULL;
 }
 
 static int convmvfs_open(const char *opath, struct fuse_file_info *fi){
-  string ipath = convmvfs.srcdir + out2in(opath);
+  oper_guard guard(RECORD_OP_OPEN, opath, NULL, fi->flags);
+  if(guard.busy())
+    return -EAGAIN;
+  string ipath;
+  int st = resolve(opath, ipath);
+  if(st)
+    return st;
 
   /* permission check*/
   struct fuse_context *cont = fuse_get_context();
-  int st;
   if(fi->flags & O_WRONLY){
     st = permission_walk(ipath.c_str(), cont->uid, cont->gid,
                            PERM_WALK_CHECK_WRITE);
@@ -317,6 +992,8 @@ static int convmvfs_open(const char *opath, struct fuse_file_info *fi){
     return -errno;
   }
   fi->fh = fd;
+  if(record_file)
+    record_bind(fi);
 
   return 0;
 }
@@ -325,6 +1002,9 @@ static int convmvfs_read(const char *opath, char *buf,
                          size_t size, off_t offset,
                          struct fuse_file_info *fi){
   (void)opath;
+  oper_guard guard(RECORD_OP_READ, opath, NULL, size, offset, fi);
+  if(guard.busy())
+    return -EAGAIN;
 
   lseek(fi->fh, offset, SEEK_SET);
   return read(fi->fh, buf, size);
@@ -332,13 +1012,18 @@ static int convmvfs_read(const char *opath, char *buf,
 
 static int convmvfs_write(const char *opath, const char *buf, size_t size, off_t off, struct fuse_file_info *fi){
   (void)opath;
+  oper_guard guard(RECORD_OP_WRITE, opath, NULL, size, off, fi);
+  if(guard.busy())
+    return -EAGAIN;
 
   lseek(fi->fh, off, SEEK_SET);
   return write(fi->fh, buf, size);
 }
 
 static int convmvfs_release(const char *opath, struct fuse_file_info *fi){
-  (void)opath;
+  /* never held back by the scheduler: it must not fail */
+  if(record_file)
+    record_oper(RECORD_OP_RELEASE, opath, NULL, 0, 0, fi);
 
   if(close(fi->fh))
     return -errno;
@@ -346,11 +1031,27 @@ static int convmvfs_release(const char *opath, struct fuse_file_info *fi){
 }
 
 static int convmvfs_getattr(const char *opath, struct stat *stbuf){
-  string ipath = convmvfs.srcdir + out2in(opath);
+  oper_guard guard(RECORD_OP_GETATTR, opath);
+  if(guard.busy())
+    return -EAGAIN;
+  if(is_vroot(opath)){
+    memset(stbuf, 0, sizeof(*stbuf));
+    stbuf->st_mode = S_IFDIR | 0555;
+    stbuf->st_nlink = 2 + views.size();
+    stbuf->st_uid = euid;
+    stbuf->st_gid = egid;
+    stbuf->st_atime = stbuf->st_mtime = stbuf->st_ctime = start_time;
+    return 0;
+  }
+
+  string ipath;
+  int st = resolve(opath, ipath);
+  if(st)
+    return st;
 
   struct fuse_context *cont = fuse_get_context();
-  int st = permission_walk_parent(ipath.c_str(), cont->uid, cont->gid,
-                                  PERM_WALK_CHECK_EXEC);
+  st = permission_walk_parent(ipath.c_str(), cont->uid, cont->gid,
+                              PERM_WALK_CHECK_EXEC);
   if(st)
     return st;
 
@@ -362,12 +1063,21 @@ static int convmvfs_getattr(const char *opath, struct stat *stbuf){
 
 static int convmvfs_opendir(const char *opath, struct fuse_file_info *fi){
   (void)fi;
-  string ipath = convmvfs.srcdir + out2in(opath);
+  oper_guard guard(RECORD_OP_OPENDIR, opath);
+  if(guard.busy())
+    return -EAGAIN;
+  if(is_vroot(opath))
+    return 0;
+
+  string ipath;
+  int st = resolve(opath, ipath);
+  if(st)
+    return st;
 
   /* permission check*/
   struct fuse_context *cont = fuse_get_context();
-  int st = permission_walk(ipath.c_str(), cont->uid, cont->gid,
-                           PERM_WALK_CHECK_READ);
+  st = permission_walk(ipath.c_str(), cont->uid, cont->gid,
+                       PERM_WALK_CHECK_READ);
   if(st)
     return st;
 
@@ -378,7 +1088,22 @@ static int convmvfs_readdir(const char *opath, void *buf, fuse_fill_dir_t filler
                          off_t offset, struct fuse_file_info *fi){
   (void)offset;
   (void)fi;
-  string ipath = convmvfs.srcdir + out2in(opath);
+  oper_guard guard(RECORD_OP_READDIR, opath);
+  if(guard.busy())
+    return -EAGAIN;
+  if(is_vroot(opath)){
+    filler(buf, ".", NULL, 0);
+    filler(buf, "..", NULL, 0);
+    for(view_map::const_iterator it = views.begin(); it != views.end(); ++it)
+      filler(buf, it->first.c_str(), NULL, 0);
+    return 0;
+  }
+
+  string ipath;
+  const struct convmvfs_view *view;
+  int st = resolve(opath, ipath, &view);
+  if(st)
+    return st;
 
   DIR * dir;
   if( (dir = opendir(ipath.c_str())) == NULL ){
@@ -387,7 +1112,7 @@ static int convmvfs_readdir(const char *opath, void *buf, fuse_fill_dir_t filler
   struct dirent *pdirent;
   pdirent = readdir(dir);
   while ( pdirent != NULL ) {
-    filler(buf, in2out(pdirent->d_name).c_str(),
+    filler(buf, in2out_name(view, pdirent->d_name).c_str(),
            NULL, 0);
     pdirent = readdir( dir );
   }
@@ -396,17 +1121,26 @@ static int convmvfs_readdir(const char *opath, void *buf, fuse_fill_dir_t filler
 }
 
 static int convmvfs_mknod (const char *opath, mode_t mode, dev_t dev){
-  string ipath = convmvfs.srcdir + out2in(opath);
+  oper_guard guard(RECORD_OP_MKNOD, opath, NULL, mode);
+  if(guard.busy())
+    return -EAGAIN;
+  string ipath;
+  const struct convmvfs_view *view;
+  int st = resolve(opath, ipath, &view);
+  if(st)
+    return st;
 
   /* permission check*/
   struct fuse_context *cont = fuse_get_context();
-  int st = permission_walk_parent(ipath.c_str(), cont->uid, cont->gid,
-                                  PERM_WALK_CHECK_WRITE|PERM_WALK_CHECK_EXEC);
+  st = permission_walk_parent(ipath.c_str(), cont->uid, cont->gid,
+                              PERM_WALK_CHECK_WRITE|PERM_WALK_CHECK_EXEC);
   if(st)
     return st;
 
+  case_index_change change(view, ipath);
   int rt = mknod(ipath.c_str(), mode, dev);
   if(rt)return -errno;
+  change.commit(1);
   if(euid == 0){
     chown(ipath.c_str(), cont->uid, cont->gid);
   }
@@ -414,17 +1148,26 @@ static int convmvfs_mknod (const char *opath, mode_t mode, dev_t dev){
 }
 
 static int convmvfs_mkdir (const char *opath, mode_t mode){
-  string ipath = convmvfs.srcdir + out2in(opath);
+  oper_guard guard(RECORD_OP_MKDIR, opath, NULL, mode);
+  if(guard.busy())
+    return -EAGAIN;
+  string ipath;
+  const struct convmvfs_view *view;
+  int st = resolve(opath, ipath, &view);
+  if(st)
+    return st;
 
   /* permission check*/
   struct fuse_context *cont = fuse_get_context();
-  int st = permission_walk_parent(ipath.c_str(), cont->uid, cont->gid,
-                                  PERM_WALK_CHECK_WRITE|PERM_WALK_CHECK_EXEC);
+  st = permission_walk_parent(ipath.c_str(), cont->uid, cont->gid,
+                              PERM_WALK_CHECK_WRITE|PERM_WALK_CHECK_EXEC);
   if(st)
     return st;
 
+  case_index_change change(view, ipath);
   int rt = mkdir(ipath.c_str(), mode);
   if(rt)return -errno;
+  change.commit(1);
   if(euid == 0){
     chown(ipath.c_str(), cont->uid, cont->gid);
   }
@@ -433,12 +1176,19 @@ static int convmvfs_mkdir (const char *opath, mode_t mode){
 
 static int convmvfs_readlink(const char *opath,
                              char *path, size_t path_len){
-  string ipath = convmvfs.srcdir + out2in(opath);
+  oper_guard guard(RECORD_OP_READLINK, opath);
+  if(guard.busy())
+    return -EAGAIN;
+  string ipath;
+  const struct convmvfs_view *view;
+  int st = resolve(opath, ipath, &view);
+  if(st)
+    return st;
 
   /* permission check*/
   struct fuse_context *cont = fuse_get_context();
-  int st = permission_walk(ipath.c_str(), cont->uid, cont->gid,
-                           PERM_WALK_CHECK_READ, 1);
+  st = permission_walk(ipath.c_str(), cont->uid, cont->gid,
+                       PERM_WALK_CHECK_READ, 1);
   if(st)
     return st;
 
@@ -446,54 +1196,89 @@ static int convmvfs_readlink(const char *opath,
   if(st == -1)
     return -errno;
   path[st] = '\0';
-  ipath = in2out(path);
+  ipath = in2out(view, path);
   strncpy(path, ipath.c_str(), min(path_len,ipath.size()+1));
 
   return 0;
 }
 
 static int convmvfs_unlink(const char *opath){
-  string ipath = convmvfs.srcdir + out2in(opath);
+  oper_guard guard(RECORD_OP_UNLINK, opath);
+  if(guard.busy())
+    return -EAGAIN;
+  string ipath;
+  const struct convmvfs_view *view;
+  int st = resolve(opath, ipath, &view);
+  if(st)
+    return st;
 
   /* permission check*/
   struct fuse_context *cont = fuse_get_context();
-  int st = permission_walk_parent(ipath.c_str(), cont->uid, cont->gid,
-                                  PERM_WALK_CHECK_WRITE|PERM_WALK_CHECK_EXEC);
+  st = permission_walk_parent(ipath.c_str(), cont->uid, cont->gid,
+                              PERM_WALK_CHECK_WRITE|PERM_WALK_CHECK_EXEC);
   if(st)
     return st;
 
+  case_index_change change(view, ipath);
   if(unlink(ipath.c_str()))
     return -errno;
+  change.commit(0);
   return 0;
 }
 
 static int convmvfs_rmdir(const char *opath){
-  string ipath = convmvfs.srcdir + out2in(opath);
+  oper_guard guard(RECORD_OP_RMDIR, opath);
+  if(guard.busy())
+    return -EAGAIN;
+  if(is_view_root(opath))
+    return -EBUSY;
+
+  string ipath;
+  const struct convmvfs_view *view;
+  int st = resolve(opath, ipath, &view);
+  if(st)
+    return st;
 
   /* permission check*/
   struct fuse_context *cont = fuse_get_context();
-  int st = permission_walk_parent(ipath.c_str(), cont->uid, cont->gid,
-                                  PERM_WALK_CHECK_WRITE|PERM_WALK_CHECK_EXEC);
+  st = permission_walk_parent(ipath.c_str(), cont->uid, cont->gid,
+                              PERM_WALK_CHECK_WRITE|PERM_WALK_CHECK_EXEC);
   if(st)
     return st;
 
+  case_index_change change(view, ipath);
   if(rmdir(ipath.c_str()))
     return -errno;
+  change.commit(0);
   return 0;
 }
 
 static int convmvfs_symlink(const char *oldpath, const char *newpath){
-  string inewpath = convmvfs.srcdir + out2in(newpath);
+  oper_guard guard(RECORD_OP_SYMLINK, newpath, oldpath);
+  if(guard.busy())
+    return -EAGAIN;
+  string inewpath;
+  const struct convmvfs_view *view;
+  int st = resolve(newpath, inewpath, &view);
+  if(st)
+    return st;
 
   /* permission check*/
   struct fuse_context *cont = fuse_get_context();
-  int st = permission_walk_parent(inewpath.c_str(), cont->uid, cont->gid,
-                                  PERM_WALK_CHECK_WRITE|PERM_WALK_CHECK_EXEC);
+  st = permission_walk_parent(inewpath.c_str(), cont->uid, cont->gid,
+                              PERM_WALK_CHECK_WRITE|PERM_WALK_CHECK_EXEC);
   if(st)
     return st;
 
-  int rt = symlink(out2in(oldpath).c_str(), inewpath.c_str());
+  string target;
+  st = out2in_strict(view, oldpath, target);
+  if(st)
+    return st;
+
+  case_index_change change(view, inewpath);
+  int rt = symlink(target.c_str(), inewpath.c_str());
   if (rt) return -errno;
+  change.commit(1);
 
   if(euid == 0){
     lchown(inewpath.c_str(), cont->uid, cont->gid);
@@ -502,13 +1287,27 @@ static int convmvfs_symlink(const char *oldpath, const char *newpath){
 }
 
 static int convmvfs_rename(const char *oldpath, const char *newpath){
-  string inewpath = convmvfs.srcdir + out2in(newpath);
-  string ioldpath = convmvfs.srcdir + out2in(oldpath);
+  oper_guard guard(RECORD_OP_RENAME, oldpath, newpath);
+  if(guard.busy())
+    return -EAGAIN;
+  if(is_view_root(oldpath) || is_view_root(newpath))
+    return -EBUSY;
+
+  string inewpath, ioldpath;
+  const struct convmvfs_view *newview, *oldview;
+  int st = resolve(newpath, inewpath, &newview);
+  if(st)
+    return st;
+  st = resolve(oldpath, ioldpath, &oldview);
+  if(st)
+    return st;
+  if(newview != oldview)
+    return -EXDEV;
 
   /* permission check*/
   struct fuse_context *cont = fuse_get_context();
-  int st = permission_walk_parent(inewpath.c_str(), cont->uid, cont->gid,
-                                  PERM_WALK_CHECK_WRITE|PERM_WALK_CHECK_EXEC);
+  st = permission_walk_parent(inewpath.c_str(), cont->uid, cont->gid,
+                              PERM_WALK_CHECK_WRITE|PERM_WALK_CHECK_EXEC);
   if(st)
     return st;
   st = permission_walk_parent(ioldpath.c_str(), cont->uid, cont->gid,
@@ -529,19 +1328,33 @@ static int convmvfs_rename(const char *oldpath, const char *newpath){
       return st;
   }
 
+  case_index_change remove(oldview, ioldpath), add(newview, inewpath);
   if(rename(ioldpath.c_str(), inewpath.c_str()))
     return -errno;
+  remove.commit(0);
+  add.commit(1);
   return 0;
 }
 
 static int convmvfs_link(const char *oldpath, const char *newpath){
-  string inewpath = convmvfs.srcdir + out2in(newpath);
-  string ioldpath = convmvfs.srcdir + out2in(oldpath);
+  oper_guard guard(RECORD_OP_LINK, oldpath, newpath);
+  if(guard.busy())
+    return -EAGAIN;
+  string inewpath, ioldpath;
+  const struct convmvfs_view *newview, *oldview;
+  int st = resolve(newpath, inewpath, &newview);
+  if(st)
+    return st;
+  st = resolve(oldpath, ioldpath, &oldview);
+  if(st)
+    return st;
+  if(newview != oldview)
+    return -EXDEV;
 
   /* permission check*/
   struct fuse_context *cont = fuse_get_context();
-  int st = permission_walk_parent(inewpath.c_str(), cont->uid, cont->gid,
-                                  PERM_WALK_CHECK_WRITE|PERM_WALK_CHECK_EXEC);
+  st = permission_walk_parent(inewpath.c_str(), cont->uid, cont->gid,
+                              PERM_WALK_CHECK_WRITE|PERM_WALK_CHECK_EXEC);
   if(st)
     return st;
   st = permission_walk_parent(ioldpath.c_str(), cont->uid, cont->gid,
@@ -549,13 +1362,21 @@ static int convmvfs_link(const char *oldpath, const char *newpath){
   if(st)
     return st;
 
+  case_index_change change(newview, inewpath);
   if(link(ioldpath.c_str(), inewpath.c_str()))
     return -errno;
+  change.commit(1);
   return 0;
 }
 
 static int convmvfs_chmod(const char *opath, mode_t mode){
-  string ipath = convmvfs.srcdir + out2in(opath);
+  oper_guard guard(RECORD_OP_CHMOD, opath, NULL, mode);
+  if(guard.busy())
+    return -EAGAIN;
+  string ipath;
+  int st = resolve(opath, ipath);
+  if(st)
+    return st;
 
   /* permission check*/
   struct fuse_context *cont = fuse_get_context();
@@ -571,12 +1392,18 @@ static int convmvfs_chmod(const char *opath, mode_t mode){
 }
 
 static int convmvfs_truncate(const char *opath, off_t length){
-  string ipath = convmvfs.srcdir + out2in(opath);
+  oper_guard guard(RECORD_OP_TRUNCATE, opath, NULL, 0, length);
+  if(guard.busy())
+    return -EAGAIN;
+  string ipath;
+  int st = resolve(opath, ipath);
+  if(st)
+    return st;
 
   /* permission check*/
   struct fuse_context *cont = fuse_get_context();
-  int st = permission_walk(ipath.c_str(), cont->uid, cont->gid,
-                           PERM_WALK_CHECK_WRITE);
+  st = permission_walk(ipath.c_str(), cont->uid, cont->gid,
+                       PERM_WALK_CHECK_WRITE);
   if(st)
     return st;
 
@@ -586,7 +1413,13 @@ static int convmvfs_truncate(const char *opath, off_t length){
 }
 
 static int convmvfs_utime(const char *opath, struct utimbuf *buf){
-  string ipath = convmvfs.srcdir + out2in(opath);
+  oper_guard guard(RECORD_OP_UTIME, opath);
+  if(guard.busy())
+    return -EAGAIN;
+  string ipath;
+  int st = resolve(opath, ipath);
+  if(st)
+    return st;
 
   /* permission check*/
   struct fuse_context *cont = fuse_get_context();
@@ -608,7 +1441,16 @@ static int convmvfs_utime(const char *opath, struct utimbuf *buf){
 }
 
 static int convmvfs_access(const char *opath, int mode){
-  string ipath = convmvfs.srcdir + out2in(opath);
+  oper_guard guard(RECORD_OP_ACCESS, opath, NULL, mode);
+  if(guard.busy())
+    return -EAGAIN;
+  if(is_vroot(opath))
+    return (mode & W_OK) ? -EACCES : 0;
+
+  string ipath;
+  int st = resolve(opath, ipath);
+  if(st)
+    return st;
 
   if(mode & F_OK){
     struct stat stbuf;
@@ -625,7 +1467,13 @@ static int convmvfs_access(const char *opath, int mode){
 }
 
 static int convmvfs_chown(const char *opath, uid_t uid_2set, gid_t gid_2set){
-  string ipath = convmvfs.srcdir + out2in(opath);
+  oper_guard guard(RECORD_OP_CHOWN, opath);
+  if(guard.busy())
+    return -EAGAIN;
+  string ipath;
+  int st = resolve(opath, ipath);
+  if(st)
+    return st;
 
   struct fuse_context *cont = fuse_get_context();
   /* FIX: grant access to chown if user is in target group */
@@ -641,11 +1489,24 @@ static int convmvfs_chown(const char *opath, uid_t uid_2set, gid_t gid_2set){
 }
 
 static int convmvfs_statfs(const char *opath, struct statvfs *buf){
-  string ipath = convmvfs.srcdir + out2in(opath);
+  oper_guard guard(RECORD_OP_STATFS, opath);
+  if(guard.busy())
+    return -EAGAIN;
+  if(is_vroot(opath)){
+    const string &srcdir = views.begin()->second.srcdir;
+    if(statvfs(srcdir.empty() ? "/" : srcdir.c_str(), buf))
+      return -errno;
+    return 0;
+  }
+
+  string ipath;
+  int st = resolve(opath, ipath);
+  if(st)
+    return st;
 
   /* permission check*/
   struct fuse_context *cont = fuse_get_context();
-  int st = permission_walk(ipath.c_str(), cont->uid, cont->gid,0);
+  st = permission_walk(ipath.c_str(), cont->uid, cont->gid,0);
   if(st)
     return st;
 
@@ -659,12 +1520,18 @@ static int convmvfs_statfs(const char *opath, struct statvfs *buf){
 #if HAVE_ATTR_XATTR_H
 
 static int convmvfs_listxattr(const char *opath, char *list, size_t listsize){
-  string ipath = convmvfs.srcdir + out2in(opath);
+  oper_guard guard(RECORD_OP_LISTXATTR, opath, NULL, listsize);
+  if(guard.busy())
+    return -EAGAIN;
+  string ipath;
+  int st = resolve(opath, ipath);
+  if(st)
+    return st;
 
   /* permission check*/
   struct fuse_context *cont = fuse_get_context();
-  int st = permission_walk_parent(ipath.c_str(), cont->uid, cont->gid,
-                                  PERM_WALK_CHECK_EXEC);
+  st = permission_walk_parent(ipath.c_str(), cont->uid, cont->gid,
+                              PERM_WALK_CHECK_EXEC);
   if(st)
     return st;
   
@@ -672,7 +1539,13 @@ static int convmvfs_listxattr(const char *opath, char *list, size_t listsize){
 }
 
 static int convmvfs_removexattr(const char *opath, const char *xattr){
-  string ipath = convmvfs.srcdir + out2in(opath);
+  oper_guard guard(RECORD_OP_REMOVEXATTR, opath, xattr);
+  if(guard.busy())
+    return -EAGAIN;
+  string ipath;
+  int st = resolve(opath, ipath);
+  if(st)
+    return st;
 
   /* permission check*/
   struct fuse_context *cont = fuse_get_context();
@@ -688,12 +1561,18 @@ static int convmvfs_removexattr(const char *opath, const char *xattr){
 }
 
 static int convmvfs_getxattr(const char *opath, const char *name, char *value, size_t valsize){
-  string ipath = convmvfs.srcdir + out2in(opath);
+  oper_guard guard(RECORD_OP_GETXATTR, opath, name, valsize);
+  if(guard.busy())
+    return -EAGAIN;
+  string ipath;
+  int st = resolve(opath, ipath);
+  if(st)
+    return st;
 
   /* permission check*/
   struct fuse_context *cont = fuse_get_context();
-  int st = permission_walk_parent(ipath.c_str(), cont->uid, cont->gid,
-                                  PERM_WALK_CHECK_EXEC);
+  st = permission_walk_parent(ipath.c_str(), cont->uid, cont->gid,
+                              PERM_WALK_CHECK_EXEC);
   if(st)
     return st;
   
@@ -705,7 +1584,13 @@ static int convmvfs_getxattr(const char *opath, const char *name, char *value, s
 }
 
 static int convmvfs_setxattr(const char *opath, const char *name, const char *value, size_t valsize, int flags){
-  string ipath = convmvfs.srcdir + out2in(opath);
+  oper_guard guard(RECORD_OP_SETXATTR, opath, name, valsize);
+  if(guard.busy())
+    return -EAGAIN;
+  string ipath;
+  int st = resolve(opath, ipath);
+  if(st)
+    return st;
 
   /* permission check*/
   struct fuse_context *cont = fuse_get_context();
@@ -724,88 +1609,201 @@ static int convmvfs_setxattr(const char *opath, const char *name, const char *va
 
 static void convmvfs_oper_init(){
   memset(&convmvfs_oper, 0, sizeof(convmvfs_oper));
-  convmvfs_oper.getattr = convmvfs_getattr;
-  convmvfs_oper.opendir = convmvfs_opendir;
-  convmvfs_oper.readdir = convmvfs_readdir;
-  convmvfs_oper.readlink = convmvfs_readlink;
-  convmvfs_oper.mknod = convmvfs_mknod;
-  convmvfs_oper.mkdir = convmvfs_mkdir;
-  convmvfs_oper.unlink = convmvfs_unlink;
-  convmvfs_oper.rmdir = convmvfs_rmdir;
-  convmvfs_oper.symlink = convmvfs_symlink;
-  convmvfs_oper.rename = convmvfs_rename;
-  convmvfs_oper.link = convmvfs_link;
-  convmvfs_oper.chmod = convmvfs_chmod;
-  convmvfs_oper.chown = convmvfs_chown;
-  convmvfs_oper.truncate = convmvfs_truncate;
-  convmvfs_oper.utime = convmvfs_utime;
-  convmvfs_oper.open = convmvfs_open;
+  convmvfs_oper.getattr = WITH_FALLBACK(convmvfs_getattr);
+  convmvfs_oper.opendir = WITH_FALLBACK(convmvfs_opendir);
+  convmvfs_oper.readdir = WITH_FALLBACK(convmvfs_readdir);
+  convmvfs_oper.readlink = WITH_FALLBACK(convmvfs_readlink);
+  convmvfs_oper.mknod = WITH_FALLBACK(convmvfs_mknod);
+  convmvfs_oper.mkdir = WITH_FALLBACK(convmvfs_mkdir);
+  convmvfs_oper.unlink = WITH_FALLBACK(convmvfs_unlink);
+  convmvfs_oper.rmdir = WITH_FALLBACK(convmvfs_rmdir);
+  convmvfs_oper.symlink = WITH_FALLBACK(convmvfs_symlink);
+  convmvfs_oper.rename = WITH_FALLBACK(convmvfs_rename);
+  convmvfs_oper.link = WITH_FALLBACK(convmvfs_link);
+  convmvfs_oper.chmod = WITH_FALLBACK(convmvfs_chmod);
+  convmvfs_oper.chown = WITH_FALLBACK(convmvfs_chown);
+  convmvfs_oper.truncate = WITH_FALLBACK(convmvfs_truncate);
+  convmvfs_oper.utime = WITH_FALLBACK(convmvfs_utime);
+  convmvfs_oper.open = WITH_FALLBACK(convmvfs_open);
   convmvfs_oper.read = convmvfs_read;
   convmvfs_oper.write = convmvfs_write;
   convmvfs_oper.release = convmvfs_release;
-  convmvfs_oper.access = convmvfs_access;
-  convmvfs_oper.statfs = convmvfs_statfs;
+  convmvfs_oper.access = WITH_FALLBACK(convmvfs_access);
+  convmvfs_oper.statfs = WITH_FALLBACK(convmvfs_statfs);
 #if HAVE_ATTR_XATTR_H
-  convmvfs_oper.listxattr = convmvfs_listxattr;
-  convmvfs_oper.removexattr = convmvfs_removexattr;
-  convmvfs_oper.getxattr = convmvfs_getxattr;
-  convmvfs_oper.setxattr = convmvfs_setxattr;
+  convmvfs_oper.listxattr = WITH_FALLBACK(convmvfs_listxattr);
+  convmvfs_oper.removexattr = WITH_FALLBACK(convmvfs_removexattr);
+  convmvfs_oper.getxattr = WITH_FALLBACK(convmvfs_getxattr);
+  convmvfs_oper.setxattr = WITH_FALLBACK(convmvfs_setxattr);
 #endif
 
   convmvfs_oper.init = convmvfs_init;
 }
 
 
+/*
+ * views setup
+ */
+static string clean_srcdir(const string &dir){
+  string srcdir = dir;
+  if(srcdir.size()){
+    if(srcdir[srcdir.size()-1] == '/'){
+      srcdir.erase(srcdir.size()-1,1);
+    }
+    size_t p;
+    while((p = srcdir.find("//")) != string::npos){
+      srcdir.erase(p,1);
+    }
+  }
+  return srcdir;
+}
+
+static struct convmvfs_conv *get_conv(const string &icharset,
+                                      const string &ocharset){
+  pair<string, string> key(icharset, ocharset);
+  conv_map::iterator it = convs.find(key);
+  if(it != convs.end())
+    return &it->second;
+
+  struct convmvfs_conv &conv = convs[key];
+  conv_init(conv, icharset, ocharset, convmvfs.namecache, convmvfs.ignorecase);
+  return &conv;
+}
+
+static void add_view(const string &name, const string &srcdir,
+                     const string &icharset, const string &ocharset){
+  if(name.find('/') != string::npos || name == "." || name == ".."){
+    fprintf(stderr, "invalid view name: %s\n", name.c_str());
+    exit(1);
+  }
+  if(views.count(name)){
+    fprintf(stderr, "duplicate view: %s\n", name.c_str());
+    exit(1);
+  }
+  struct convmvfs_view &view = views[name];
+  view.name = name;
+  view.srcdir = clean_srcdir(srcdir);
+  view.icharset = icharset.size() ? icharset : convmvfs.icharset;
+  view.ocharset = ocharset.size() ? ocharset : convmvfs.ocharset;
+  view.conv = get_conv(view.icharset, view.ocharset);
+}
+
+/* NAME:PATH[:ICHARSET[:OCHARSET]] */
+static void parse_view_spec(const string &spec){
+  vector<string> f;
+  size_t b = 0, e;
+  do{
+    e = spec.find(':', b);
+    f.push_back(spec.substr(b, e == string::npos ? e : e - b));
+    b = e + 1;
+  }while(e != string::npos);
+  if(f.size() < 2 || f.size() > 4 || f[0].empty() || f[1].empty()){
+    fprintf(stderr, "invalid view: %s\n", spec.c_str());
+    exit(1);
+  }
+  f.resize(4);
+  add_view(f[0], f[1], f[2], f[3]);
+}
+
+/* one "NAME PATH [ICHARSET [OCHARSET]]" per line, '#' starts a comment */
+static void read_viewfile(const char *file){
+  ifstream in(file);
+  if(!in){
+    perror(file);
+    exit(1);
+  }
+  string line;
+  while(getline(in, line)){
+    size_t c = line.find('#');
+    if(c != string::npos)
+      line.erase(c);
+    istringstream ls(line);
+    string name, srcdir, icharset, ocharset;
+    if(!(ls >> name))
+      continue;
+    if(!(ls >> srcdir)){
+      fprintf(stderr, "%s: invalid view: %s\n", file, line.c_str());
+      exit(1);
+    }
+    ls >> icharset >> ocharset;
+    add_view(name, srcdir, icharset, ocharset);
+  }
+}
+
 /*
  * life is here
  */
 int main(int argc, char *argv[])
 {
   int res;
-  string srcdir;
 
   init_gvars();
 
   struct fuse_args args = FUSE_ARGS_INIT(argc, argv);  
   if (fuse_opt_parse(&args, &convmvfs, convmvfs_opts, convmvfs_opt_proc) == -1)
     exit(1);
-  if(strlen(convmvfs.srcdir)){
-    srcdir = convmvfs.srcdir;
-    if(srcdir[srcdir.size()-1] == '/'){
-      srcdir.erase(srcdir.size()-1,1);
+
+  if(convmvfs.normalize){
+    if(!strcasecmp(convmvfs.normalize, "nfc")){
+      normalize_form = NORMALIZE_NFC;
+    }else if(!strcasecmp(convmvfs.normalize, "nfd")){
+      normalize_form = NORMALIZE_NFD;
+    }else if(strcasecmp(convmvfs.normalize, "none")){
+      fprintf(stderr, "unknown normalization form: %s\n", convmvfs.normalize);
+      exit(1);
     }
-    size_t p;
-    while((p = srcdir.find("//")) != string::npos){
-      srcdir.erase(p,1);
+#if !HAVE_ICU
+    if(normalize_form != NORMALIZE_NONE){
+      fprintf(stderr, "normalize: built without ICU support\n");
+      exit(1);
     }
-    convmvfs.srcdir = srcdir.c_str();
+#endif
+  }
+
+  for(size_t i = 0; i < view_specs.size(); ++i)
+    parse_view_spec(view_specs[i]);
+  if(convmvfs.viewfile)
+    read_viewfile(convmvfs.viewfile);
+  if(views.empty()){
+    add_view("", convmvfs.srcdir, convmvfs.icharset, convmvfs.ocharset);
+  }else{
+    multiview = 1;
   }
 
   convmvfs_oper_init();
 
-  fprintf(stderr,
-          "srcdir=%s\n"
-          "icharset=%s\n"
-          "ocharset=%s\n",
-          convmvfs.srcdir,
-          convmvfs.icharset,
-          convmvfs.ocharset);
-
-  ic_out2in = iconv_open(convmvfs.icharset,convmvfs.ocharset);
-  if( ic_out2in == (iconv_t)(-1) ){
-    perror("iconv out2in");
-    exit(1);
+  for(view_map::const_iterator it = views.begin(); it != views.end(); ++it){
+    const struct convmvfs_view &view = it->second;
+    if(multiview)
+      fprintf(stderr, "view=%s\n", view.name.c_str());
+    fprintf(stderr,
+            "srcdir=%s\n"
+            "icharset=%s\n"
+            "ocharset=%s\n",
+            view.srcdir.c_str(),
+            view.icharset.c_str(),
+            view.ocharset.c_str());
   }
-  ic_in2out = iconv_open(convmvfs.ocharset,convmvfs.icharset);
-  if( ic_in2out == (iconv_t)(-1) ){
-    perror("iconv in2out");
-    exit(1);
+
+  if(convmvfs.record){
+    record_file = fopen(convmvfs.record, "w");
+    if(record_file == NULL){
+      perror(convmvfs.record);
+      exit(1);
+    }
+    fputs(RECORD_MAGIC, record_file);
+    record_start_us = record_now_us();
   }
 
   res = fuse_main(args.argc, args.argv, &convmvfs_oper);
 
-  iconv_close(ic_out2in);
-  iconv_close(ic_in2out);
+  if(record_file){
+    record_finish();
+    fclose(record_file);
+  }
+
+  for(conv_map::iterator it = convs.begin(); it != convs.end(); ++it)
+    conv_close(it->second);
 
   return res;
 }
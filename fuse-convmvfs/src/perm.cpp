@@ -0,0 +1,117 @@
+/* (C) 2006-2010 ZC Miao <hellwolf.misty@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ */
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <errno.h>
+
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#include "perm.h"
+
+using namespace std;
+
+int permission_walk(const char *path, uid_t uid, gid_t gid,
+                    int perm_chk, int readlink){
+  int rt;
+  //I'm root~~
+  if(uid == 0){
+    return 0;
+  }
+  size_t l = strlen(path) + 1;
+  char *p = (char*)malloc(l);
+  if(p == NULL){
+    return -ENOMEM;
+  }
+  strncpy(p, path, l);
+
+  char *s = p;
+  if(*s == '\0'){
+    //Empty pathname, see PATH_RESOLUTION(2)
+    rt = -ENOENT;
+    goto __free_quit;
+  }
+  while(*s++){
+    struct stat stbuf;
+    int chk;
+    if(*s == '\0'){
+      //final entry
+      if(readlink?lstat(p, &stbuf):stat(p, &stbuf)){
+        rt = -errno;
+        goto __free_quit;
+      }
+      chk = perm_chk;
+    }else if(*s == '/'){
+      //non-final component
+      *s = '\0';
+      if(stat(p, &stbuf)){
+        rt =  -errno;
+        goto __free_quit;
+      }
+      if(!(stbuf.st_mode & S_IFDIR)){
+        rt = -ENOTDIR;
+        goto __free_quit;
+      }
+      *s = '/';
+      chk = PERM_WALK_CHECK_EXEC;
+    }else{
+      continue;
+    }
+    int mr,mw,mx;
+    if(stbuf.st_uid == uid){
+      mr = S_IRUSR;
+      mw = S_IWUSR;
+      mx = S_IXUSR;
+    }else if(stbuf.st_gid == gid){
+      mr = S_IRGRP;
+      mw = S_IWGRP;
+      mx = S_IXGRP;
+    }else{
+      mr = S_IROTH;
+      mw = S_IWOTH;
+      mx = S_IXOTH;
+    }
+    if(chk & PERM_WALK_CHECK_READ){
+      if(!(stbuf.st_mode & mr)){
+        rt = -EACCES;
+        goto __free_quit;
+      }
+    }
+    if(chk & PERM_WALK_CHECK_WRITE){
+      if(!(stbuf.st_mode & mw)){
+        rt = -EACCES;
+        goto __free_quit;
+      }
+    }
+    if(chk & PERM_WALK_CHECK_EXEC){
+      if(!(stbuf.st_mode & mx)){
+        rt = -EACCES;
+        goto __free_quit;
+      }
+    }
+  }
+
+  rt = 0;
+__free_quit:
+  free(p);
+  return rt;
+}
+
+int permission_walk_parent(const char *path, uid_t uid, gid_t gid,
+                           int perm_chk){
+  int l = strlen(path);
+  while(--l)
+    if(path[l] == '/')
+      break;
+  return permission_walk(string(path, l).c_str(), uid, gid,
+                         perm_chk);
+}
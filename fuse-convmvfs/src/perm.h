@@ -0,0 +1,35 @@
+/* (C) 2006-2010 ZC Miao <hellwolf.misty@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ */
+
+/*
+ * Permission checks of a request against the source tree, done on behalf
+ * of the requesting user since convmvfs itself may run as root. Used by
+ * convmvfs and convmvfs-bench.
+ */
+
+#ifndef CONVMVFS_PERM_H
+#define CONVMVFS_PERM_H
+
+#include <sys/types.h>
+
+#define PERM_WALK_CHECK_READ   01
+#define PERM_WALK_CHECK_WRITE  02
+#define PERM_WALK_CHECK_EXEC   04
+
+/*
+ * 0 if uid/gid may search every directory on path and access its last
+ * component as asked by perm_chk, else -errno; with readlink the last
+ * component itself is checked, not what it links to
+ */
+int permission_walk(const char *path, uid_t uid, gid_t gid,
+                    int perm_chk, int readlink = 0);
+/* permission_walk() of the directory holding path */
+int permission_walk_parent(const char *path, uid_t uid, gid_t gid,
+                           int perm_chk);
+
+#endif /* CONVMVFS_PERM_H */
@@ -0,0 +1,150 @@
+/* (C) 2006-2010 ZC Miao <hellwolf.misty@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ */
+
+/*
+ * Workload record format, written by convmvfs -o record=FILE and read by
+ * convmvfs-replay.
+ *
+ * The file starts with RECORD_MAGIC, followed by one record per request:
+ *
+ *   varint  microseconds since the previous record
+ *   byte    operation, one of RECORD_OP_*
+ *   varint  uid
+ *   varint  size   (read/write size, open flags, access/chmod mode)
+ *   varint  offset (read/write offset, truncate length)
+ *   varint  handle (open/read/write/release: the open file, numbered from
+ *           1 in the order of the opens; otherwise 0)
+ *   varint  length of path, then path as seen in the mount
+ *   varint  length of path2, then path2 (link target, xattr name or empty)
+ *
+ * Varints are little-endian base 128, 7 bits per byte.
+ */
+
+#ifndef CONVMVFS_RECORD_H
+#define CONVMVFS_RECORD_H
+
+#include <stdint.h>
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+#define RECORD_MAGIC "CVMREC2\n"
+#define RECORD_MAGIC_LEN 8
+
+enum {
+  RECORD_OP_GETATTR,
+  RECORD_OP_READLINK,
+  RECORD_OP_MKNOD,
+  RECORD_OP_MKDIR,
+  RECORD_OP_UNLINK,
+  RECORD_OP_RMDIR,
+  RECORD_OP_SYMLINK,
+  RECORD_OP_RENAME,
+  RECORD_OP_LINK,
+  RECORD_OP_CHMOD,
+  RECORD_OP_CHOWN,
+  RECORD_OP_TRUNCATE,
+  RECORD_OP_UTIME,
+  RECORD_OP_OPEN,
+  RECORD_OP_READ,
+  RECORD_OP_WRITE,
+  RECORD_OP_STATFS,
+  RECORD_OP_OPENDIR,
+  RECORD_OP_READDIR,
+  RECORD_OP_ACCESS,
+  RECORD_OP_LISTXATTR,
+  RECORD_OP_REMOVEXATTR,
+  RECORD_OP_GETXATTR,
+  RECORD_OP_SETXATTR,
+  RECORD_OP_RELEASE,
+  RECORD_OPS,
+};
+
+static const char *const record_op_names[RECORD_OPS] = {
+  "getattr", "readlink", "mknod", "mkdir", "unlink", "rmdir", "symlink",
+  "rename", "link", "chmod", "chown", "truncate", "utime", "open", "read",
+  "write", "statfs", "opendir", "readdir", "access", "listxattr",
+  "removexattr", "getxattr", "setxattr", "release",
+};
+
+struct record {
+  uint64_t time_us;             /* since the start of the recording */
+  int op;
+  uint64_t uid;
+  uint64_t size;
+  uint64_t offset;
+  uint64_t fh;
+  std::string path;
+  std::string path2;
+};
+
+inline void record_put_varint(std::string &buf, uint64_t v){
+  while(v >= 0x80){
+    buf += (char)(v | 0x80);
+    v >>= 7;
+  }
+  buf += (char)v;
+}
+
+inline void record_put_string(std::string &buf, const char *s){
+  size_t l = s ? strlen(s) : 0;
+  record_put_varint(buf, l);
+  buf.append(s ? s : "", l);
+}
+
+/* append r to buf, with its time relative to the previous record */
+inline void record_encode(std::string &buf, const struct record &r,
+                          uint64_t prev_us){
+  record_put_varint(buf, r.time_us - prev_us);
+  buf += (char)r.op;
+  record_put_varint(buf, r.uid);
+  record_put_varint(buf, r.size);
+  record_put_varint(buf, r.offset);
+  record_put_varint(buf, r.fh);
+  record_put_string(buf, r.path.c_str());
+  record_put_string(buf, r.path2.c_str());
+}
+
+inline int record_get_varint(FILE *f, uint64_t &v){
+  int c, shift = 0;
+  v = 0;
+  do{
+    if((c = getc(f)) == EOF || shift > 63)
+      return -1;
+    v |= (uint64_t)(c & 0x7f) << shift;
+    shift += 7;
+  }while(c & 0x80);
+  return 0;
+}
+
+inline int record_get_string(FILE *f, std::string &s){
+  uint64_t l;
+  if(record_get_varint(f, l) || l > 65536)
+    return -1;
+  s.resize(l);
+  if(l && fread(&s[0], 1, l, f) != l)
+    return -1;
+  return 0;
+}
+
+/* read the next record into r; returns -1 at end of file or on error */
+inline int record_decode(FILE *f, struct record &r, uint64_t prev_us){
+  uint64_t delta;
+  int op;
+  if(record_get_varint(f, delta) || (op = getc(f)) == EOF || op >= RECORD_OPS)
+    return -1;
+  r.time_us = prev_us + delta;
+  r.op = op;
+  if(record_get_varint(f, r.uid) || record_get_varint(f, r.size) ||
+     record_get_varint(f, r.offset) || record_get_varint(f, r.fh) ||
+     record_get_string(f, r.path) || record_get_string(f, r.path2))
+    return -1;
+  return 0;
+}
+
+#endif /* CONVMVFS_RECORD_H */
@@ -0,0 +1,380 @@
+/* (C) 2006-2010 ZC Miao <hellwolf.misty@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ */
+
+/*
+ * convmvfs-replay: reissue a workload recorded with convmvfs -o record=FILE
+ * against the tree at ROOT, usually another convmvfs mount, and report
+ * throughput and latency percentiles per operation as JSON.
+ *
+ * Requests are replayed as the user running convmvfs-replay, at their
+ * recorded times divided by the speed factor, or back to back with -s 0.
+ * Each recorded open keeps its descriptor until its recorded release, and
+ * reads and writes of that open use a dup() of it, so a release on another
+ * thread can not close it under them. A read or write whose open has not
+ * been replayed, e.g. because another thread is still at it, opens the file
+ * for itself; a release replayed before its open makes the open close its
+ * descriptor at once. Operations that change the tree are skipped unless -w is
+ * given.
+ */
+
+#include "config.h"
+
+#include <unistd.h>
+#include <sys/param.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <utime.h>
+
+#if HAVE_ATTR_XATTR_H
+#include <attr/xattr.h>
+#endif
+
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <algorithm>
+
+#include "record.h"
+
+using namespace std;
+
+struct replay_stats {
+  vector<double> lat[RECORD_OPS];   /* microseconds */
+  long errors[RECORD_OPS];
+  long skipped;
+};
+
+static vector<struct record> records;
+static string root;
+static double speed = 1;
+static int allow_write;
+static size_t next_record;
+static pthread_mutex_t next_mutex = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t start_us;
+static map<uint64_t, int> handles;    /* recorded handle to descriptor */
+static set<uint64_t> released;        /* released before their open */
+static pthread_mutex_t handles_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t now_us(){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int is_write_op(int op){
+  switch(op){
+  case RECORD_OP_MKNOD:
+  case RECORD_OP_MKDIR:
+  case RECORD_OP_UNLINK:
+  case RECORD_OP_RMDIR:
+  case RECORD_OP_SYMLINK:
+  case RECORD_OP_RENAME:
+  case RECORD_OP_LINK:
+  case RECORD_OP_CHMOD:
+  case RECORD_OP_CHOWN:
+  case RECORD_OP_TRUNCATE:
+  case RECORD_OP_UTIME:
+  case RECORD_OP_WRITE:
+  case RECORD_OP_REMOVEXATTR:
+  case RECORD_OP_SETXATTR:
+    return 1;
+  default:
+    return 0;
+  }
+}
+
+/* a dup() of the descriptor of handle fh, to be closed by the caller */
+static int handle_fd(uint64_t fh){
+  int fd = -1;
+  pthread_mutex_lock(&handles_mutex);
+  map<uint64_t, int>::iterator it = handles.find(fh);
+  if(it != handles.end())
+    fd = dup(it->second);
+  pthread_mutex_unlock(&handles_mutex);
+  return fd;
+}
+
+/* pread or pwrite r on the descriptor of its open, or on the file itself */
+static int replay_io(const struct record &r, const string &path, char *buf,
+                     size_t len){
+  int fd = r.fh ? handle_fd(r.fh) : -1;
+  if(fd == -1 &&
+     (fd = open(path.c_str(), r.op == RECORD_OP_WRITE ? O_WRONLY : O_RDONLY))
+     == -1)
+    return -1;
+  ssize_t n = r.op == RECORD_OP_WRITE ?
+    pwrite(fd, buf, min((size_t)r.size, len), r.offset) :
+    pread(fd, buf, min((size_t)r.size, len), r.offset);
+  close(fd);
+  return n < 0 ? -1 : 0;
+}
+
+/* returns 0 on success, -1 on error, 1 if the operation was not replayed */
+static int replay(const struct record &r){
+  string path = root + r.path;
+  string path2 = root + r.path2;
+  struct stat stbuf;
+  char buf[65536];
+  int fd;
+
+  switch(r.op){
+  case RECORD_OP_GETATTR:
+    return lstat(path.c_str(), &stbuf) ? -1 : 0;
+  case RECORD_OP_READLINK:
+    return readlink(path.c_str(), buf, sizeof(buf)) < 0 ? -1 : 0;
+  case RECORD_OP_MKNOD:
+    return mknod(path.c_str(), r.size, 0) ? -1 : 0;
+  case RECORD_OP_MKDIR:
+    return mkdir(path.c_str(), r.size) ? -1 : 0;
+  case RECORD_OP_UNLINK:
+    return unlink(path.c_str()) ? -1 : 0;
+  case RECORD_OP_RMDIR:
+    return rmdir(path.c_str()) ? -1 : 0;
+  case RECORD_OP_SYMLINK:
+    return symlink(r.path2.c_str(), path.c_str()) ? -1 : 0;
+  case RECORD_OP_RENAME:
+    return rename(path.c_str(), path2.c_str()) ? -1 : 0;
+  case RECORD_OP_LINK:
+    return link(path.c_str(), path2.c_str()) ? -1 : 0;
+  case RECORD_OP_CHMOD:
+    return chmod(path.c_str(), r.size) ? -1 : 0;
+  case RECORD_OP_CHOWN:
+    return 1;
+  case RECORD_OP_TRUNCATE:
+    return truncate(path.c_str(), r.offset) ? -1 : 0;
+  case RECORD_OP_UTIME:
+    return utime(path.c_str(), NULL) ? -1 : 0;
+  case RECORD_OP_OPEN:
+    fd = open(path.c_str(), allow_write ? r.size : O_RDONLY, 0644);
+    if(r.fh){
+      pthread_mutex_lock(&handles_mutex);
+      /* a release that came first has been held back for this open */
+      int early = released.erase(r.fh);
+      if(!early && fd != -1)
+        handles[r.fh] = fd;
+      pthread_mutex_unlock(&handles_mutex);
+      if(early && fd != -1)
+        close(fd);
+    }else if(fd != -1){
+      close(fd);
+    }
+    return fd == -1 ? -1 : 0;
+  case RECORD_OP_RELEASE:
+    pthread_mutex_lock(&handles_mutex);
+    {
+      map<uint64_t, int>::iterator it = handles.find(r.fh);
+      fd = -1;
+      if(it != handles.end()){
+        fd = it->second;
+        handles.erase(it);
+      }else{
+        released.insert(r.fh);
+      }
+    }
+    pthread_mutex_unlock(&handles_mutex);
+    if(fd == -1)
+      return 0;
+    return close(fd) ? -1 : 0;
+  case RECORD_OP_READ:
+    return replay_io(r, path, buf, sizeof(buf));
+  case RECORD_OP_WRITE:
+    memset(buf, 0, sizeof(buf));
+    return replay_io(r, path, buf, sizeof(buf));
+  case RECORD_OP_STATFS:
+    struct statvfs vfsbuf;
+    return statvfs(path.c_str(), &vfsbuf) ? -1 : 0;
+  case RECORD_OP_OPENDIR:
+  case RECORD_OP_READDIR:
+    {
+      DIR *dir = opendir(path.c_str());
+      if(dir == NULL)
+        return -1;
+      if(r.op == RECORD_OP_READDIR)
+        while(readdir(dir) != NULL)
+          ;
+      closedir(dir);
+      return 0;
+    }
+  case RECORD_OP_ACCESS:
+    return access(path.c_str(), r.size & (R_OK|W_OK|X_OK)) ? -1 : 0;
+#if HAVE_ATTR_XATTR_H
+  case RECORD_OP_LISTXATTR:
+    return llistxattr(path.c_str(), buf, sizeof(buf)) < 0 ? -1 : 0;
+  case RECORD_OP_REMOVEXATTR:
+    return lremovexattr(path.c_str(), r.path2.c_str()) ? -1 : 0;
+  case RECORD_OP_GETXATTR:
+    return lgetxattr(path.c_str(), r.path2.c_str(), buf, sizeof(buf)) < 0 &&
+      errno != ENODATA ? -1 : 0;
+  case RECORD_OP_SETXATTR:
+    memset(buf, 0, sizeof(buf));
+    return lsetxattr(path.c_str(), r.path2.c_str(), buf,
+                     min((size_t)r.size, sizeof(buf)), 0) ? -1 : 0;
+#endif
+  default:
+    return 1;
+  }
+}
+
+static void *replay_thread(void *data){
+  struct replay_stats *stats = (struct replay_stats *)data;
+
+  for(;;){
+    pthread_mutex_lock(&next_mutex);
+    size_t i = next_record++;
+    pthread_mutex_unlock(&next_mutex);
+    if(i >= records.size())
+      break;
+
+    const struct record &r = records[i];
+    if(is_write_op(r.op) && !allow_write){
+      ++stats->skipped;
+      continue;
+    }
+    if(speed > 0){
+      uint64_t due = start_us + (uint64_t)(r.time_us / speed);
+      uint64_t now = now_us();
+      if(due > now)
+        usleep(due - now);
+    }
+    uint64_t t = now_us();
+    int rt = replay(r);
+    if(rt > 0){
+      ++stats->skipped;
+      continue;
+    }
+    stats->lat[r.op].push_back(now_us() - t);
+    if(rt)
+      ++stats->errors[r.op];
+  }
+  return NULL;
+}
+
+static int load(const char *file){
+  FILE *f = fopen(file, "r");
+  if(f == NULL){
+    perror(file);
+    return -1;
+  }
+  char magic[RECORD_MAGIC_LEN];
+  if(fread(magic, 1, sizeof(magic), f) != sizeof(magic) ||
+     memcmp(magic, RECORD_MAGIC, RECORD_MAGIC_LEN)){
+    fprintf(stderr, "%s: not a convmvfs record file\n", file);
+    fclose(f);
+    return -1;
+  }
+  struct record r;
+  uint64_t prev_us = 0;
+  while(!record_decode(f, r, prev_us)){
+    prev_us = r.time_us;
+    records.push_back(r);
+  }
+  fclose(f);
+  return 0;
+}
+
+static double percentile(const vector<double> &v, int p){
+  return v.empty() ? 0 : v[min(v.size() - 1, v.size() * p / 100)];
+}
+
+static void usage(const char *prog){
+  fprintf(stderr,
+          "usage: %s [-t THREADS] [-s SPEED] [-w] FILE ROOT\n"
+          "    -t THREADS   replay with THREADS threads (4)\n"
+          "    -s SPEED     replay SPEED times faster than recorded (1),\n"
+          "                 0 for as fast as possible\n"
+          "    -w           also replay operations that change the tree\n",
+          prog);
+}
+
+int main(int argc, char *argv[])
+{
+  int nthreads = 4;
+  int c;
+  while((c = getopt(argc, argv, "t:s:wh")) != -1){
+    switch(c){
+    case 't':
+      nthreads = atoi(optarg);
+      break;
+    case 's':
+      speed = atof(optarg);
+      break;
+    case 'w':
+      allow_write = 1;
+      break;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if(argc - optind != 2 || nthreads < 1 || speed < 0){
+    usage(argv[0]);
+    return 1;
+  }
+  if(load(argv[optind]))
+    return 1;
+  root = argv[optind + 1];
+  if(root.size() && root[root.size()-1] == '/')
+    root.erase(root.size()-1);
+
+  vector<struct replay_stats> stats(nthreads);
+  vector<pthread_t> threads(nthreads);
+  for(int i = 0; i < nthreads; ++i){
+    memset(stats[i].errors, 0, sizeof(stats[i].errors));
+    stats[i].skipped = 0;
+  }
+  start_us = now_us();
+  for(int i = 0; i < nthreads; ++i)
+    pthread_create(&threads[i], NULL, replay_thread, &stats[i]);
+  for(int i = 0; i < nthreads; ++i)
+    pthread_join(threads[i], NULL);
+  double seconds = (now_us() - start_us) / 1e6;
+  /* opens whose release was not recorded */
+  for(map<uint64_t, int>::iterator it = handles.begin(); it != handles.end();
+      ++it)
+    close(it->second);
+
+  long replayed = 0, skipped = 0;
+  for(int i = 0; i < nthreads; ++i)
+    skipped += stats[i].skipped;
+  printf("{\n  \"records\": %zu,\n  \"threads\": %d,\n  \"speed\": %g,\n"
+         "  \"seconds\": %.3f,\n  \"ops\": {",
+         records.size(), nthreads, speed, seconds);
+  int first = 1;
+  for(int op = 0; op < RECORD_OPS; ++op){
+    vector<double> lat;
+    long errors = 0;
+    for(int i = 0; i < nthreads; ++i){
+      lat.insert(lat.end(), stats[i].lat[op].begin(), stats[i].lat[op].end());
+      errors += stats[i].errors[op];
+    }
+    if(lat.empty())
+      continue;
+    sort(lat.begin(), lat.end());
+    replayed += lat.size();
+    printf("%s\n    \"%s\": {\"count\": %zu, \"errors\": %ld, \"p50_us\": %.0f, "
+           "\"p90_us\": %.0f, \"p99_us\": %.0f, \"max_us\": %.0f}",
+           first ? "" : ",", record_op_names[op], lat.size(), errors,
+           percentile(lat, 50), percentile(lat, 90), percentile(lat, 99),
+           lat.back());
+    first = 0;
+  }
+  printf("\n  },\n  \"replayed\": %ld,\n  \"skipped\": %ld,\n"
+         "  \"ops_per_sec\": %.0f\n}\n",
+         replayed, skipped, seconds > 0 ? replayed / seconds : 0);
+  return 0;
+}